@@ -0,0 +1,220 @@
+// Host benchmark: status JSON built by string concatenation and framed into a shared heap string (as before
+// json_writer), against json_writer into a static buffer framed into a pooled buffer (as now).
+// Reports output bytes, heap allocations and time per document.
+#include "json_writer.h"
+#include "ws_frame.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static size_t g_allocs = 0;
+static size_t g_alloc_bytes = 0;
+
+void* operator new(size_t n) {
+    g_allocs++;
+    g_alloc_bytes += n;
+    if (void *p = malloc(n ? n : 1)) return p;
+    throw bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+namespace {
+
+// the fields of app_state and the httpd counters the status documents carry
+struct central {
+    uint16_t id;
+    string name;
+    bool is_active;
+    string addr;
+    string addr_type;
+    uint32_t interval_us, latency, sent, dropped;
+};
+
+struct status {
+    uint32_t version{4711};
+    uint64_t uptime{86400};
+    string ip{"192.168.178.42"};
+    bool adv{true}, broadcast{false}, rollover{true};
+    string layout{"de"};
+    vector<central> centrals;
+    uint32_t depth{2}, hw{14}, ovf{0};
+    uint32_t cmds{123456}, frames{23456}, batches{345}, rate{120}, cmd_ns{8500}, clients{2}, tx_drop{0}, tx_sup{17};
+};
+
+string bool_str(bool b) { return b ? "true" : "false"; }
+
+// ---- before: operator+ and to_string ----
+
+string old_centrals(const status& s) {
+    string a = "[";
+    for (size_t i = 0; i < s.centrals.size(); i++) {
+        const central& c = s.centrals[i];
+        string elem = "{";
+        elem += "\"id\":"           + to_string(c.id);
+        elem += ",\"name\":\""      + c.name + "\"";
+        elem += ",\"is_active\":"   + string(c.is_active ? "true" : "false");
+        elem += ",\"addr\":\""      + c.addr + "\"";
+        elem += ",\"addr_type\":\"" + c.addr_type + "\"";
+        elem += ",\"interval_us\":"  + to_string(c.interval_us);
+        elem += ",\"latency\":"      + to_string(c.latency);
+        elem += ",\"sent\":"         + to_string(c.sent);
+        elem += ",\"dropped\":"      + to_string(c.dropped);
+        elem += "}";
+        a += elem;
+        if (i < s.centrals.size() - 1) a += ",";
+    }
+    return a + "]";
+}
+
+string old_state(const status& s) {
+    string hid_q = string("{\"depth\":") + to_string(s.depth) +
+        ",\"hw\":"  + to_string(s.hw) +
+        ",\"ovf\":" + to_string(s.ovf) + "}";
+    string ws = string("{\"cmds\":") + to_string(s.cmds) +
+        ",\"frames\":"  + to_string(s.frames) +
+        ",\"batches\":" + to_string(s.batches) +
+        ",\"rate\":"    + to_string(s.rate) +
+        ",\"cmd_ns\":"  + to_string(s.cmd_ns) +
+        ",\"clients\":" + to_string(s.clients) +
+        ",\"tx_drop\":" + to_string(s.tx_drop) +
+        ",\"tx_superseded\":" + to_string(s.tx_sup) + "}";
+    return string("{\"v\":") + to_string(s.version) +
+        ",\"full\":true" +
+        ",\"uptime\":" + to_string(s.uptime) +
+        ",\"ip\":\""    + s.ip + "\"" +
+        ",\"bt_adv\":"  + bool_str(s.adv) +
+        ",\"bt_broadcast\":" + bool_str(s.broadcast) +
+        ",\"kbd_layout\":\"" + s.layout + "\"" +
+        ",\"type_rollover\":" + bool_str(s.rollover) +
+        ",\"bt_devices\":" + old_centrals(s) +
+        ",\"hid_q\":" + hid_q +
+        ",\"ws\":" + ws + "}";
+}
+
+shared_ptr<const string> old_frame(const string& payload) {
+    auto f = make_shared<string>();
+    f->reserve(payload.size() + 4);
+    f->push_back((char)0x81);
+    if (payload.size() < 126) {
+        f->push_back((char)payload.size());
+    } else {
+        f->push_back((char)126);
+        f->push_back((char)((payload.size() >> 8) & 0xff));
+        f->push_back((char)(payload.size() & 0xff));
+    }
+    f->append(payload);
+    return f;
+}
+
+// ---- now: json_writer into a static buffer, pooled frame ----
+
+char json_buf[2048];
+
+size_t new_state(const status& s, json_writer& w) {
+    w.reset();
+    w.begin_object()
+        .field("v", s.version)
+        .field("full", true)
+        .field("uptime", s.uptime)
+        .field("ip", s.ip)
+        .field("bt_adv", s.adv)
+        .field("bt_broadcast", s.broadcast)
+        .field("kbd_layout", s.layout)
+        .field("type_rollover", s.rollover);
+    w.key("bt_devices").begin_array();
+    for (const central& c : s.centrals) {
+        w.begin_object()
+            .field("id", c.id)
+            .field("name", c.name)
+            .field("is_active", c.is_active)
+            .field("addr", c.addr)
+            .field("addr_type", c.addr_type)
+            .field("interval_us", c.interval_us)
+            .field("latency", c.latency)
+            .field("sent", c.sent)
+            .field("dropped", c.dropped)
+            .end_object();
+    }
+    w.end_array();
+    w.key("hid_q").begin_object().field("depth", s.depth).field("hw", s.hw).field("ovf", s.ovf).end_object();
+    w.key("ws").begin_object()
+        .field("cmds", s.cmds)
+        .field("frames", s.frames)
+        .field("batches", s.batches)
+        .field("rate", s.rate)
+        .field("cmd_ns", s.cmd_ns)
+        .field("clients", s.clients)
+        .field("tx_drop", s.tx_drop)
+        .field("tx_superseded", s.tx_sup)
+        .end_object();
+    w.end_object();
+    return w.size();
+}
+
+struct result {
+    size_t bytes;
+    double allocs;
+    double alloc_bytes;
+    double ns;
+};
+
+template <typename F>
+result run(int iterations, F fn) {
+    size_t bytes = 0;
+    size_t allocs = g_allocs, alloc_bytes = g_alloc_bytes;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) bytes = fn();
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    return result{bytes, (double)(g_allocs - allocs) / iterations, (double)(g_alloc_bytes - alloc_bytes) / iterations,
+                  (double)ns / iterations};
+}
+
+void print(const char *name, const result& r) {
+    printf("%-8s %6zu bytes %8.1f allocs %9.1f heap bytes %9.1f ns\n", name, r.bytes, r.allocs, r.alloc_bytes, r.ns);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    status s;
+    const char *names[] = {"MacBook Pro", "Living room \"TV\"", "Büro-PC", "iPad"};
+    for (uint16_t i = 0; i < 4; i++) {
+        char addr[18];
+        snprintf(addr, sizeof(addr), "C0:FF:EE:00:00:%02X", i);
+        s.centrals.push_back(central{(uint16_t)(64 + i), names[i], i == 0, addr, i % 2 ? "random" : "public",
+                                     15000, 0, 10000u * i, i});
+    }
+
+    json_writer w(json_buf, sizeof(json_buf));
+    size_t old_bytes = 0, new_bytes = 0;
+    result before = run(iterations, [&]() {
+        auto f = old_frame(old_state(s));
+        old_bytes = f->size();
+        return f->size();
+    });
+    result now = run(iterations, [&]() {
+        new_state(s, w);
+        ws_frame_ref f = ws_frame_ref::make(reinterpret_cast<const uint8_t*>(w.data()), w.size(), 0x01);
+        new_bytes = f ? f.size() : 0;
+        return new_bytes;
+    });
+
+    printf("full status with %zu centrals, %d iterations\n", s.centrals.size(), iterations);
+    print("before", before);
+    print("now", now);
+    // the old builder didn't escape names, so the outputs differ by the escapes
+    printf("size difference %+d bytes (escaped quotes)\n", (int)new_bytes - (int)old_bytes);
+    if (!w.ok() || now.allocs != 0 || ws_frame_pool_usage().large_used != 0) {
+        printf("FAIL: the status path allocated, overflowed or leaked a frame\n");
+        return 1;
+    }
+    return 0;
+}
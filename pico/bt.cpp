@@ -1,33 +1,107 @@
 #include "bt.h"
 #include "log.h"
+#include "core_load.h"
+#include <string.h>
 #include <stdio.h>
 #include <string>
 #include <inttypes.h>
+#include <algorithm>
 
 using namespace std;
 
-//report IDs for the different HID reports.
-//must correspond to the HID report map!
-enum class report_id : uint16_t {
-    none = 0,
-    kbd = 1,
-    mouse = 2
-    // mouse_abs = 5
+/**
+ * Send state of one connected central. Every link has its own report queue, mouse accumulator and
+ * CAN_SEND_NOW request, so a slow central never holds up the others.
+ */
+struct hid_link {
+    hci_con_handle_t conn{HCI_CON_HANDLE_INVALID};
+    uint8_t protocol_mode{1};
+    bool ready{false};               // subscribed to an input report, or bonded link re-encrypted
+    bool can_send_requested{false};  // a CAN_SEND_NOW event is already on its way
+
+    // reports waiting for HIDS CAN_SEND_NOW, drained one per event in submission order.
+    // producer: submit() (WebSocket commands), consumer: execute_send() (HIDS packet handler)
+    spsc_ring<hid_report, HID_REPORT_QUEUE_SIZE> queue;
+
+    // relative mouse motion not sent yet, only touched from the async context (lwIP and BTstack callbacks)
+    hid_mouse_accumulator mouse;
+
+    // latest absolute position not sent yet, newer positions replace it
+    hid_report abs;
+    bool abs_pending{false};
+    uint8_t abs_buttons{0};
+
+    uint32_t sent{0};
+    uint32_t dropped{0};
 };
 
-//buffers for the different HID reports
-//sizes are determined by the HID report map (look for report count & size)
-uint8_t hid_rpt_kbd[8];     // 1 modifier byte, 1 reserved byte, 6 key codes
-uint8_t hid_rpt_mouse[4];   // 1 byte for buttons, 1 byte for X, 1 byte for Y, 1 byte for wheel movement
-volatile report_id hid_rpt_to_send = report_id::none; // report to send, set by the peripheral handler
-
-// uint8_t hid_rpt_mouse_abs[5]; // 1 byte for buttons, 2 bytes for X, 2 bytes for Y
-//currently used report ID, determines the kind of report to be sent after an ATT notification
+static hid_link links[BRPI_MAX_BT_CONNECTIONS];
 
 static btstack_packet_callback_registration_t hci_event_callback_registration;
 static btstack_packet_callback_registration_t sm_event_callback_registration;
 static uint8_t battery = 95;
-static uint8_t protocol_mode = 1;
+
+static hid_link* link_find(hci_con_handle_t conn) {
+    if(conn == HCI_CON_HANDLE_INVALID) return nullptr;
+    for(hid_link& l : links) {
+        if(l.conn == conn) return &l;
+    }
+    return nullptr;
+}
+
+static void link_reset(hid_link& l) {
+    l.conn = HCI_CON_HANDLE_INVALID;
+    l.protocol_mode = 1;
+    l.ready = false;
+    l.can_send_requested = false;
+    l.queue.clear();
+    l.mouse.clear();
+    l.mouse.buttons(0);
+    l.abs_pending = false;
+    l.abs_buttons = 0;
+    l.sent = 0;
+    l.dropped = 0;
+}
+
+static void link_open(hci_con_handle_t conn) {
+    if(link_find(conn)) return;
+    for(hid_link& l : links) {
+        if(l.conn == HCI_CON_HANDLE_INVALID) {
+            link_reset(l);
+            l.conn = conn;
+            return;
+        }
+    }
+    if(log_enabled()) log("No free HID link slot for %u", conn);
+}
+
+static void link_close(hci_con_handle_t conn) {
+    hid_link* l = link_find(conn);
+    if(l) link_reset(*l);
+}
+
+/**
+ * Calls f for every link input goes to: all ready links in broadcast mode, otherwise the current central.
+ * Returns false if there was no target at all.
+ */
+template <typename F>
+static bool for_each_target(F f) {
+    if(bt::g_bt->broadcast) {
+        bool any = false;
+        for(hid_link& l : links) {
+            if(l.conn != HCI_CON_HANDLE_INVALID && l.ready) {
+                f(l);
+                any = true;
+            }
+        }
+        return any;
+    }
+
+    hid_link* l = link_find(hid_central::current().conn);
+    if(!l) return false;
+    f(*l);
+    return true;
+}
 
 // --- Remote device name discovery via GATT client ---
 
@@ -118,81 +192,271 @@ const uint8_t adv_data[] = {
 };
 const uint8_t adv_data_len = sizeof(adv_data);
 
-// HID Report sending
+// Advertising phases
+
+static btstack_timer_source_t adv_timer;
+static hid_central::bond adv_targets[BT_ADV_DIRECTED_MAX_TARGETS];
+static size_t adv_target_count = 0;
+static size_t adv_target_next = 0;
+
+static void adv_set_phase(app_adv_phase phase) {
+    app_state& as = bt::g_bt->as;
+    if(as.bt_adv_phase == phase) return;
+    as.bt_adv_phase = phase;
+    as.mark(APP_DIRTY_BT_ADV);
+    if(bt::g_bt->on_state_change) bt::g_bt->on_state_change();
+}
+
+// Moves on to the next directed target, then to fast and slow undirected advertising.
+static void adv_timer_handler(btstack_timer_source_t* ts) {
+    bd_addr_t null_addr;
+    memset(null_addr, 0, 6);
+    uint32_t next_ms = 0;
+
+    if(adv_target_next < adv_target_count) {
+        hid_central::bond& b = adv_targets[adv_target_next++];
+        // high duty cycle ADV_DIRECT_IND, the interval doesn't apply
+        gap_advertisements_set_params(BT_ADV_FAST_INTERVAL, BT_ADV_FAST_INTERVAL, 1, b.addr_type, b.addr, 0x07, 0x00);
+        if(log_enabled()) log("advertising directed at %s", bd_addr_to_str(b.addr));
+        adv_set_phase(app_adv_phase::directed);
+        next_ms = BT_ADV_DIRECTED_MS;
+    } else if(bt::g_bt->as.bt_adv_phase != app_adv_phase::fast) {
+        gap_advertisements_set_params(BT_ADV_FAST_INTERVAL, BT_ADV_FAST_INTERVAL, 0, 0, null_addr, 0x07, 0x00);
+        adv_set_phase(app_adv_phase::fast);
+        next_ms = BT_ADV_FAST_MS;
+    } else {
+        gap_advertisements_set_params(BT_ADV_SLOW_INTERVAL, BT_ADV_SLOW_INTERVAL, 0, 0, null_addr, 0x07, 0x00);
+        adv_set_phase(app_adv_phase::slow);
+        return;
+    }
+
+    btstack_run_loop_set_timer_handler(ts, adv_timer_handler);
+    btstack_run_loop_set_timer(ts, next_ms);
+    btstack_run_loop_add_timer(ts);
+}
+
+// Connection parameters
+
+static btstack_timer_source_t conn_idle_timer;
+static bool conn_idle_timer_active = false;
+static uint32_t last_input_ms = 0;
+
+static void request_conn_params(hid_central& c, hid_central::conn_params_state st) {
+    bool fast = st == hid_central::conn_params_state::fast;
+    uint16_t int_min = fast ? BT_CONN_FAST_INTERVAL_MIN : BT_CONN_IDLE_INTERVAL_MIN;
+    uint16_t int_max = fast ? BT_CONN_FAST_INTERVAL_MAX : BT_CONN_IDLE_INTERVAL_MAX;
+    uint16_t latency = fast ? BT_CONN_FAST_LATENCY : BT_CONN_IDLE_LATENCY;
+
+    c.cp_state = st;
+
+    // nothing to negotiate if the central already runs inside the requested range
+    if(c.conn_interval >= int_min && c.conn_interval <= int_max && c.conn_latency == latency) return;
+
+    int status = gap_request_connection_parameter_update(c.conn, int_min, int_max, latency, BT_CONN_SUPERVISION_TIMEOUT);
+    if(log_enabled()) log("Requesting %s connection parameters on %u: %u-%u, latency %u, status %d",
+        fast ? "fast" : "relaxed", c.conn, int_min, int_max, latency, status);
+}
+
+static void conn_idle_timer_handler(btstack_timer_source_t* ts) {
+    uint32_t idle_for = btstack_run_loop_get_time_ms() - last_input_ms;
+    uint32_t idle_ms = bt::g_bt->conn_idle_ms;
+    if(idle_for < idle_ms) {
+        // input arrived since the timer was armed, sleep for the remainder
+        btstack_run_loop_set_timer(ts, idle_ms - idle_for);
+        btstack_run_loop_add_timer(ts);
+        return;
+    }
+
+    conn_idle_timer_active = false;
+    for(hid_central& c : hid_central::centrals()) {
+        if(c.cp_state == hid_central::conn_params_state::fast) {
+            request_conn_params(c, hid_central::conn_params_state::relaxed);
+        }
+    }
+}
 
 /**
- * Sends report based on the last_report_id (selects which hid_rpt_* to send).
- * The report is sent using the appropriate function based on the protocol mode.
- * If the last_report_id is report_id::none, it does nothing.
- * After sending the report, it resets last_report_id to report_id::none.
+ * Called whenever input is about to be sent to a central: asks for a short connection interval
+ * if the link is not fast already, and (re)starts the idle countdown.
  */
-static uint8_t send_report(hid_central& central, report_id rid) {
+static void note_input(hci_con_handle_t conn) {
+    last_input_ms = btstack_run_loop_get_time_ms();
+
+    hid_central* c = hid_central::find(conn);
+    if(c && c->cp_state != hid_central::conn_params_state::fast) {
+        request_conn_params(*c, hid_central::conn_params_state::fast);
+    }
+
+    if(!conn_idle_timer_active) {
+        conn_idle_timer_active = true;
+        btstack_run_loop_set_timer_handler(&conn_idle_timer, conn_idle_timer_handler);
+        btstack_run_loop_set_timer(&conn_idle_timer, bt::g_bt->conn_idle_ms);
+        btstack_run_loop_add_timer(&conn_idle_timer);
+    }
+}
+
+static void store_conn_params(hci_con_handle_t conn, uint16_t interval, uint16_t latency, uint16_t timeout) {
+    hid_central* c = hid_central::find(conn);
+    if(!c) return;
+    c->conn_interval = interval;
+    c->conn_latency = latency;
+    c->supervision_timeout = timeout;
+}
 
-    // log("handle: %u != %u (%s)", central.conn, HCI_CON_HANDLE_INVALID, central.addr.c_str());
+// HID Report sending
 
-    // wait until we can send a report
-    // while(!hid_can_send_now) {
-    //     if(log_enabled()) log("Waiting for HID Can Send Now...");
-    // } 
+/**
+ * Sends a single queued report to the central.
+ * The report is sent using the appropriate function based on the link's protocol mode.
+ */
+static uint8_t send_report(hid_link& link, const hid_report& rpt) {
     uint8_t status = ERROR_CODE_SUCCESS;
+    const uint8_t* d = rpt.data;
+    uint8_t protocol_mode = link.protocol_mode;
 
-    switch(rid) {
+    switch(rpt.id) {
         case report_id::kbd:
 
-            if(log_enabled()) log("Keyboard - mod: %02x res: %02x codes (6): %02x / %02x / %02x / %02x / %02x / %02x - mode: %d / id: %d\n",
-                hid_rpt_kbd[0], hid_rpt_kbd[1],
-                hid_rpt_kbd[2], hid_rpt_kbd[3], hid_rpt_kbd[4], hid_rpt_kbd[5], hid_rpt_kbd[6], hid_rpt_kbd[7],
-                protocol_mode, rid);
+            if(log_enabled()) log("Keyboard - mod: %02x res: %02x codes (6): %02x / %02x / %02x / %02x / %02x / %02x - mode: %d / id: %d / conn: %u\n",
+                d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7],
+                protocol_mode, rpt.id, link.conn);
 
             if(protocol_mode == 0) {
-                status = hids_device_send_boot_keyboard_input_report(central.conn, hid_rpt_kbd, sizeof(hid_rpt_kbd));
+                status = hids_device_send_boot_keyboard_input_report(link.conn, d, rpt.len);
             }
             else if(protocol_mode == 1) {
-                status = hids_device_send_input_report_for_id(central.conn, static_cast<uint16_t>(rid), hid_rpt_kbd, sizeof(hid_rpt_kbd));
+                status = hids_device_send_input_report_for_id(link.conn, static_cast<uint16_t>(rpt.id), d, rpt.len);
             }
 
             break;
 
         case report_id::mouse:
             if(protocol_mode == 0) {
-                status = hids_device_send_boot_mouse_input_report(central.conn, hid_rpt_mouse, sizeof(hid_rpt_mouse));
+                status = hids_device_send_boot_mouse_input_report(link.conn, d, rpt.len);
             }
             else if(protocol_mode == 1) {
-                status = hids_device_send_input_report_for_id(central.conn, static_cast<uint16_t>(rid), hid_rpt_mouse, sizeof(hid_rpt_mouse));
+                status = hids_device_send_input_report_for_id(link.conn, static_cast<uint16_t>(rpt.id), d, rpt.len);
             }
-            if(log_enabled()) log("Mouse: %dx%d - buttons: %02x - mode: %d / id: %d", hid_rpt_mouse[1], hid_rpt_mouse[2], hid_rpt_mouse[0], protocol_mode, rid);
+            if(log_enabled()) log("Mouse: %dx%d - buttons: %02x - mode: %d / id: %d / conn: %u", d[1], d[2], d[0], protocol_mode, rpt.id, link.conn);
             break;
 
-        // case report_id::mouse_abs:
-        //     if(protocol_mode == 0) if(log_enabled()) log("Cannot send mouse with absolute positioning in boot mode");
-        //     else if(protocol_mode == 1) {
-        //         hid_can_send_now = false;
-        //         status = hids_device_send_input_report_for_id(central.conn, static_cast<uint16_t>(rid), hid_rpt_mouse_abs, sizeof(hid_rpt_mouse_abs));
-        //     }
-        //     if(log_enabled()) log("Abs Mouse: %dx%d - buttons: %02x - mode: %d / id: %d", hid_rpt_mouse_abs[1], hid_rpt_mouse_abs[3], hid_rpt_mouse_abs[0], protocol_mode, rid);
-        //     hid_can_send_now = false; // reset the flag, we sent the report
-        //     break;
+        case report_id::mouse_wide:
+            if(protocol_mode == 0) {
+                if(log_enabled()) log("Cannot send 16-bit mouse report in boot mode");
+                status = ERROR_CODE_COMMAND_DISALLOWED;
+            }
+            else if(protocol_mode == 1) {
+                status = hids_device_send_input_report_for_id(link.conn, static_cast<uint16_t>(rpt.id), d, rpt.len);
+            }
+            if(log_enabled()) log("Mouse: %dx%d - wheel: %d / pan: %d - buttons: %02x - mode: %d / id: %d / conn: %u",
+                static_cast<int16_t>(d[1] | (d[2] << 8)), static_cast<int16_t>(d[3] | (d[4] << 8)),
+                static_cast<int8_t>(d[5]), static_cast<int8_t>(d[6]), d[0], protocol_mode, rpt.id, link.conn);
+            break;
+
+        case report_id::mouse_abs:
+            if(protocol_mode == 0) {
+                // the boot mouse report only knows relative motion
+                if(log_enabled()) log("Cannot send mouse with absolute positioning in boot mode");
+                status = ERROR_CODE_COMMAND_DISALLOWED;
+            }
+            else if(protocol_mode == 1) {
+                status = hids_device_send_input_report_for_id(link.conn, static_cast<uint16_t>(rpt.id), d, rpt.len);
+            }
+            if(log_enabled()) log("Abs Mouse: %ux%u - buttons: %02x - mode: %d / id: %d / conn: %u",
+                d[1] | (d[2] << 8), d[3] | (d[4] << 8), d[0], protocol_mode, rpt.id, link.conn);
+            break;
 
         default:
-            if(log_enabled()) log("last_report_id == 0, don't know which report to send");
+            if(log_enabled()) log("report id %u is unknown, don't know how to send it", static_cast<unsigned>(rpt.id));
     }
 
     return status;
 }
 
-static void execute_send() {
-    hid_central& central = hid_central::current();
-    if(!central) {
-        hid_rpt_to_send = report_id::none; // reset the report to send
-        if(log_enabled()) log("No current central, cannot send report");
-        return; // no current central
+/**
+ * Asks HIDS for a CAN_SEND_NOW event on the link, unless one is already on its way.
+ */
+static void request_can_send_now(hid_link& link) {
+    if(link.can_send_requested) return;
+
+    uint8_t status = hids_device_request_can_send_now_event(link.conn);
+    if(status != ERROR_CODE_SUCCESS) {
+        if(log_enabled()) log("Error requesting can send now event on %u: %02x", link.conn, status);
+        return;
+    }
+    link.can_send_requested = true;
+}
+
+/**
+ * Moves the next chunk of the link's accumulated mouse motion into r: the 16-bit report in report
+ * mode, the 8-bit one (which is what the boot mouse takes) in boot mode.
+ */
+static bool take_motion(hid_link& link, hid_report& r, bool force = false) {
+    if(link.protocol_mode == 1) {
+        r.id = report_id::mouse_wide;
+        r.len = 7;
+        return link.mouse.take_wide(r.data, force);
+    }
+    r.id = report_id::mouse;
+    r.len = 4;
+    return link.mouse.take(r.data, force);
+}
+
+/**
+ * CAN_SEND_NOW handler: sends the oldest report queued for that connection and re-arms itself until
+ * the link has nothing left.
+ */
+static void execute_send(hci_con_handle_t conn) {
+    hid_link* link = link_find(conn);
+    if(!link) {
+        if(log_enabled()) log("CAN_SEND_NOW for unknown connection %u", conn);
+        return;
+    }
+    link->can_send_requested = false;
+
+    // queued reports (keys, button transitions) go first, accumulated motion fills the idle events
+    uint8_t status;
+    hid_report* rpt = link->queue.front();
+    bool from_queue = rpt != nullptr;
+    if(from_queue) {
+        status = send_report(*link, *rpt);
+        link->queue.pop();
+    } else {
+        hid_report motion;
+        if(take_motion(*link, motion)) {
+            status = send_report(*link, motion);
+        } else if(link->abs_pending) {
+            link->abs_pending = false;
+            status = send_report(*link, link->abs);
+        } else {
+            return;
+        }
+    }
+
+    if(status == ERROR_CODE_SUCCESS) {
+        link->sent++;
+        app_state& as = bt::g_bt->as;
+        if(as.boot_first_report_ms == 0) {
+            as.boot_first_report_ms = to_ms_since_boot(get_absolute_time());
+            as.mark(APP_DIRTY_STATS);
+            if(log_enabled()) log("first HID report %u ms after power-on", as.boot_first_report_ms);
+        }
+    } else {
+        link->dropped++;
+        if(log_enabled()) log("Error sending report on %u: %02x", conn, status);
     }
 
-    send_report(central, hid_rpt_to_send);
-    hid_rpt_to_send = report_id::none;
+    if(from_queue && bt::g_bt->on_report_sent) {
+        bt::g_bt->on_report_sent();
+    }
+
+    if(!link->queue.empty() || link->mouse.pending() || link->abs_pending) {
+        request_can_send_now(*link);
+    }
 }
 
 static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packet, uint16_t size) {
+    busy_scope busy;
     UNUSED(channel);
     UNUSED(size);
     uint16_t conn_interval;
@@ -200,10 +464,22 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
     if(packet_type != HCI_EVENT_PACKET) return;
 
     switch(hci_event_packet_get_type(packet)) {
+        case BTSTACK_EVENT_STATE:
+            if(btstack_event_state_get_state(packet) == HCI_STATE_WORKING && bt::g_bt->as.boot_bt_ms == 0) {
+                bt::g_bt->as.boot_bt_ms = to_ms_since_boot(get_absolute_time());
+                bt::g_bt->as.mark(APP_DIRTY_STATS);
+                if(log_enabled()) log("Bluetooth up %u ms after power-on", bt::g_bt->as.boot_bt_ms);
+                // bonding data is loaded now, bonded hosts get directed advertising first
+                bt::g_bt->adv_restart();
+            }
+            break;
         case HCI_EVENT_DISCONNECTION_COMPLETE: {
             hci_con_handle_t conn = hci_event_disconnection_complete_get_connection_handle(packet);
+            link_close(conn);
             hid_central::disconnect(conn);
             bt::g_bt->update_as();
+            // the host may come right back, and there's a free slot again
+            bt::g_bt->adv_restart();
             if(log_enabled()) {
                 log("device disconnected:");
                 log("  handle: %u", conn);
@@ -264,6 +540,9 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
             hci_con_handle_t enc_conn = hci_event_encryption_change_get_connection_handle(packet);
             if (hci_event_encryption_change_get_encryption_enabled(packet)) {
                 if (log_enabled()) log("Encryption enabled on %u", enc_conn);
+                // bonded centrals don't necessarily re-subscribe, an encrypted HID link is ready for input
+                hid_link* l = link_find(enc_conn);
+                if (l) l->ready = true;
                 // delay name query to let central finish its own GATT discovery first
                 schedule_name_query(enc_conn, 2000);
             }
@@ -276,6 +555,12 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
         case HCI_EVENT_LE_META:
             switch(hci_event_le_meta_get_subevent_code(packet)) {
                 case HCI_SUBEVENT_LE_CONNECTION_COMPLETE: {
+                    uint8_t status = hci_subevent_le_connection_complete_get_status(packet);
+                    if(status != ERROR_CODE_SUCCESS) {
+                        // 0x3c: directed advertising ran out before the central answered
+                        if(log_enabled()) log("LE connection not established: 0x%02x", status);
+                        break;
+                    }
                     // print connection parameters (without using float operations)
                     conn_interval = hci_subevent_le_connection_complete_get_conn_interval(packet);
                     uint8_t addr_type = hci_subevent_le_connection_complete_get_peer_address_type(packet);
@@ -284,6 +569,10 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
                     bd_addr_t addr{0};
                     hci_subevent_le_connection_complete_get_peer_address(packet, addr);
                     hid_central hc = hid_central::connect(conn, addr, addr_type);
+                    link_open(conn);
+                    store_conn_params(conn, conn_interval,
+                        hci_subevent_le_connection_complete_get_conn_latency(packet),
+                        hci_subevent_le_connection_complete_get_supervision_timeout(packet));
                     bt::g_bt->update_as();
                     if(log_enabled()) {
                         log("LE device connected:");
@@ -293,10 +582,16 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
                         log("      addr: %s (%s)", hc.addr.c_str(), addr_type_str.c_str());
                     }
                     
+                    app_state& as = bt::g_bt->as;
+                    if(as.boot_central_ms == 0) {
+                        as.boot_central_ms = to_ms_since_boot(get_absolute_time());
+                        as.mark(APP_DIRTY_STATS);
+                        if(log_enabled()) log("first central connected %u ms after power-on", as.boot_central_ms);
+                    }
+
                     if(hid_central::size() < BRPI_MAX_BT_CONNECTIONS) {
-                        // keep advertisting if we have space for more devices
-                        hci_send_cmd(&hci_le_set_advertise_enable, 1);
-                        // hci_send_cmd(&hci_le_set_scan_enable, 1);
+                        // keep advertising if we have space for more devices, directed at the other bonded ones first
+                        bt::g_bt->adv_restart();
                         if(log_enabled()) log("       dev: %u < %u", hid_central::size(), BRPI_MAX_BT_CONNECTIONS);
                     }
 
@@ -309,6 +604,10 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
                     if(log_enabled()) log("LE Connection Update:");
                     if(log_enabled()) log("- Connection Interval: %u.%02u ms", conn_interval * 125 / 100, 25 * (conn_interval & 3));
                     if(log_enabled()) log("- Connection Latency: %u", hci_subevent_le_connection_update_complete_get_conn_latency(packet));
+                    store_conn_params(hci_subevent_le_connection_update_complete_get_connection_handle(packet), conn_interval,
+                        hci_subevent_le_connection_update_complete_get_conn_latency(packet),
+                        hci_subevent_le_connection_update_complete_get_supervision_timeout(packet));
+                    bt::g_bt->update_as();
                 }
                                                                break;
                 default:
@@ -317,7 +616,9 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
             break;
         case HCI_EVENT_HIDS_META:
             switch(hci_event_hids_meta_get_subevent_code(packet)) {
-                case HIDS_SUBEVENT_INPUT_REPORT_ENABLE:
+                case HIDS_SUBEVENT_INPUT_REPORT_ENABLE: {
+                    hid_link* l = link_find(hids_subevent_input_report_enable_get_con_handle(packet));
+                    if(l && hids_subevent_input_report_enable_get_enable(packet)) l->ready = true;
                     if(log_enabled()) {
                         log("report characteristic subscribed");
                         log("     enable: %u", hids_subevent_input_report_enable_get_enable(packet));
@@ -325,20 +626,23 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
                         log("     handle: %u", hids_subevent_input_report_enable_get_con_handle(packet));
                     }
                     break;
+                }
                 case HIDS_SUBEVENT_BOOT_KEYBOARD_INPUT_REPORT_ENABLE:
                     if(log_enabled()) log("Boot Keyboard Characteristic Subscribed %u", hids_subevent_boot_keyboard_input_report_enable_get_enable(packet));
                     break;
                 case HIDS_SUBEVENT_BOOT_MOUSE_INPUT_REPORT_ENABLE:
                     if(log_enabled()) log("Boot Mouse Characteristic Subscribed %u", hids_subevent_boot_mouse_input_report_enable_get_enable(packet));
                     break;
-                case HIDS_SUBEVENT_PROTOCOL_MODE:
-                    protocol_mode = hids_subevent_protocol_mode_get_protocol_mode(packet);
+                case HIDS_SUBEVENT_PROTOCOL_MODE: {
+                    hid_link* l = link_find(hids_subevent_protocol_mode_get_con_handle(packet));
+                    if(l) l->protocol_mode = hids_subevent_protocol_mode_get_protocol_mode(packet);
                     if(log_enabled()) log("Protocol Mode: %s mode", hids_subevent_protocol_mode_get_protocol_mode(packet) ? "Report" : "Boot");
                     break;
+                }
                 case HIDS_SUBEVENT_CAN_SEND_NOW:
                     if(log_enabled()) log("===================HID Can Send Now");
                     // on_hid_can_send_now();
-                    execute_send();
+                    execute_send(hids_subevent_can_send_now_get_con_handle(packet));
                     break;
                 default:
                     break;
@@ -405,15 +709,9 @@ void bt::init() {
     // setup HID Device service
     hids_device_init(44, HidReportMap, sizeof(HidReportMap));
 
-    // setup advertisements
-    uint16_t adv_int_min = 0x0030;
-    uint16_t adv_int_max = 0x0030;
-    uint8_t adv_type = 0;
-    bd_addr_t null_addr;
-    memset(null_addr, 0, 6);
-    gap_advertisements_set_params(adv_int_min, adv_int_max, adv_type, 0, null_addr, 0x07, 0x00);
+    // setup advertisements, the parameters follow the phases of adv_restart() once the stack is up
     gap_advertisements_set_data(adv_data_len, (uint8_t*)adv_data);
-    gap_advertisements_enable(1);
+    as.is_advertising = is_advertising;
 
     // register for HCI events
     hci_event_callback_registration.callback = &packet_handler;
@@ -438,9 +736,28 @@ void bt::start()  {
 
 void bt::adv_toggle() {
     is_advertising = !is_advertising;
-    hci_send_cmd(&hci_le_set_advertise_enable, is_advertising ? 1 : 0);
     log("advertising %s", is_advertising ? "enabled" : "disabled");
     as.is_advertising = is_advertising;
+    as.mark(APP_DIRTY_BT_ADV);
+    adv_restart();
+    if(on_state_change) on_state_change();
+}
+
+void bt::adv_restart() {
+    btstack_run_loop_remove_timer(&adv_timer);
+    if(!is_advertising) {
+        gap_advertisements_enable(0);
+        adv_set_phase(app_adv_phase::off);
+        return;
+    }
+
+    adv_target_count = hid_central::reconnect_targets(adv_targets, BT_ADV_DIRECTED_MAX_TARGETS);
+    adv_target_next = 0;
+    // from the top: fast comes after the directed targets even if it was the phase already
+    as.bt_adv_phase = app_adv_phase::off;
+    adv_timer_handler(&adv_timer);
+    // BTstack keeps it on (and pauses it while all connection slots are taken)
+    gap_advertisements_enable(1);
 }
 
 bool bt::activate_central(uint16_t central_id) {
@@ -463,52 +780,201 @@ void bt::unpair_central(uint16_t central_id) {
     update_as();
 }
 
+void bt::set_broadcast(bool on) {
+    broadcast = on;
+    as.bt_broadcast = on;
+    as.mark(APP_DIRTY_BT_BROADCAST);
+    log("broadcast %s", on ? "enabled" : "disabled");
+    if(on_state_change) on_state_change();
+}
+
 void bt::update_as() {
     as.bt_central_count = hid_central::size();
     as.bt_centrals.clear();
-    as.bt_centrals_json_array.clear();
     for(hid_central& c: hid_central::centrals()) {
         bool is_active = (c.conn == hid_central::current().conn);
-        as.bt_centrals.push_back(app_bt_central{c.conn, c.name, is_active, c.addr, hid_central::addr_type_to_str(c.addr_t)});
+        hid_link* l = link_find(c.conn);
+        as.bt_centrals.push_back(app_bt_central{c.conn, c.name, is_active, c.addr, hid_central::addr_type_to_str(c.addr_t),
+            c.conn_interval * 1250u, c.conn_latency,
+            l ? l->sent : 0, l ? l->dropped : 0});
     }
+    as.mark(APP_DIRTY_CENTRALS);
+    if(on_state_change) on_state_change();
 }
 
-static void submit(report_id rid) {
-    hid_central& central = hid_central::current();
-    if(!central) {
-        if(log_enabled) log("No current central, cannot send report");
-        return;
+bt::queue_stats bt::hid_queue_stats() const {
+    // depth is that of the fullest target queue, so producers pace themselves to the slowest target
+    queue_stats qs{0, 0, 0};
+    for_each_target([&qs](hid_link& l) {
+        qs.depth = max(qs.depth, static_cast<uint32_t>(l.queue.size()));
+    });
+    for(hid_link& l : links) {
+        qs.high_water = max(qs.high_water, l.queue.high_water());
+        qs.overflows += l.queue.overflows();
     }
+    return qs;
+}
 
-    if(hid_rpt_to_send != report_id::none) {
-        // A can_send_now is already in flight; update what to send and let the
-        // existing callback pick it up (avoids queueing a second event).
-        hid_rpt_to_send = rid;
-        return;
+uint32_t bt::input_idle_ms() const {
+    return btstack_run_loop_get_time_ms() - last_input_ms;
+}
+
+void bt::update_stats() {
+    queue_stats qs = hid_queue_stats();
+    if(qs.depth != as.hid_queue_depth || qs.high_water != as.hid_queue_high_water || qs.overflows != as.hid_queue_overflows) {
+        as.hid_queue_depth = qs.depth;
+        as.hid_queue_high_water = qs.high_water;
+        as.hid_queue_overflows = qs.overflows;
+        as.mark(APP_DIRTY_STATS);
     }
 
-    hid_rpt_to_send = rid;
-    uint8_t status = hids_device_request_can_send_now_event(central.conn);
-    if(status != ERROR_CODE_SUCCESS) {
-        if(log_enabled) log("Error requesting can send now event: %02x", status);
-        hid_rpt_to_send = report_id::none;
+    bool changed = false;
+    for(app_bt_central& c : as.bt_centrals) {
+        hid_link* l = link_find(c.id);
+        uint32_t sent = l ? l->sent : 0;
+        uint32_t dropped = l ? l->dropped : 0;
+        changed |= (sent != c.reports_sent || dropped != c.reports_dropped);
+        c.reports_sent = sent;
+        c.reports_dropped = dropped;
     }
+    if(changed) as.mark(APP_DIRTY_CENTRALS);
+}
+
+static bool submit_to(hid_link& link, const hid_report& rpt) {
+    if(!link.queue.push(rpt)) {
+        link.dropped++;
+        if(log_enabled()) log("HID report queue for %u full, dropping report %u", link.conn, static_cast<unsigned>(rpt.id));
+        return false;
+    }
+
+    note_input(link.conn);
+    request_can_send_now(link);
+    return true;
+}
+
+static bool submit(report_id rid, const uint8_t* data, uint8_t len) {
+    hid_report rpt;
+    rpt.id = rid;
+    rpt.len = len;
+    memcpy(rpt.data, data, len);
+
+    bool queued = false;
+    bool any = for_each_target([&](hid_link& l) {
+        queued |= submit_to(l, rpt);
+    });
+    if(!any && log_enabled()) log("No target central, cannot send report");
+    return queued;
 }
 
 
 void bt::send_key_press(uint8_t keycode) {
-    hid_kbd_rpt_set_keycode(hid_rpt_kbd, keycode);
-    submit(report_id::kbd);
-    hid_kbd_rpt_set_keycode(hid_rpt_kbd, 0);
-    submit(report_id::kbd);
+    uint8_t rpt[8];
+    hid_kbd_rpt_set_keycode(rpt, keycode);
+    submit(report_id::kbd, rpt, sizeof(rpt));
+    hid_kbd_rpt_set_keycode(rpt, 0);
+    submit(report_id::kbd, rpt, sizeof(rpt));
 }
 
-void bt::send_key_report(const uint8_t report[8]) {
-    memcpy(hid_rpt_kbd, report, sizeof(hid_rpt_kbd));
-    submit(report_id::kbd);
+bool bt::send_key_report(const uint8_t report[8]) {
+    return submit(report_id::kbd, report, 8);
+}
+
+bool bt::send_key_report_to(uint16_t central_id, const uint8_t report[8]) {
+    hid_link* l = link_find(central_id);
+    if(!l) {
+        if(log_enabled()) log("Central %u not connected, cannot send report", central_id);
+        return false;
+    }
+
+    hid_report rpt;
+    rpt.id = report_id::kbd;
+    rpt.len = 8;
+    memcpy(rpt.data, report, 8);
+    return submit_to(*l, rpt);
+}
+
+static void submit_mouse(hid_link& link, uint8_t buttons, int16_t dx, int16_t dy, int8_t wheel, int8_t pan) {
+    if(buttons == link.mouse.buttons()) {
+        // plain motion: coalesce until the next connection event
+        link.mouse.add(dx, dy, wheel, pan);
+        note_input(link.conn);
+        request_can_send_now(link);
+        return;
+    }
+
+    // button transition: motion so far happened with the old buttons, so it must reach the host first
+    hid_report motion;
+    while(take_motion(link, motion)) {
+        if(!link.queue.push(motion)) {
+            link.dropped++;
+            link.mouse.clear();
+            break;
+        }
+    }
+
+    // the transition itself carries the first chunk of its own motion
+    link.mouse.buttons(buttons);
+    link.mouse.add(dx, dy, wheel, pan);
+    hid_report rpt;
+    take_motion(link, rpt, true);
+    submit_to(link, rpt);
 }
 
 void bt::send_mouse_report(const uint8_t report[4]) {
-    memcpy(hid_rpt_mouse, report, sizeof(hid_rpt_mouse));
-    submit(report_id::mouse);
+    bool any = for_each_target([report](hid_link& l) {
+        submit_mouse(l, report[0], static_cast<int8_t>(report[1]), static_cast<int8_t>(report[2]), static_cast<int8_t>(report[3]), 0);
+    });
+    if(!any && log_enabled()) log("No target central, cannot send report");
+}
+
+bool bt::send_mouse_report_to(uint16_t central_id, const uint8_t report[4]) {
+    hid_link* l = link_find(central_id);
+    if(!l) {
+        if(log_enabled()) log("Central %u not connected, cannot send report", central_id);
+        return false;
+    }
+    submit_mouse(*l, report[0], static_cast<int8_t>(report[1]), static_cast<int8_t>(report[2]), static_cast<int8_t>(report[3]), 0);
+    return true;
+}
+
+void bt::send_mouse_wide_report(uint8_t buttons, int16_t dx, int16_t dy, int8_t wheel, int8_t pan) {
+    bool any = for_each_target([=](hid_link& l) {
+        submit_mouse(l, buttons, dx, dy, wheel, pan);
+    });
+    if(!any && log_enabled()) log("No target central, cannot send report");
+}
+
+static void submit_mouse_abs(hid_link& link, const uint8_t report[5]) {
+    if(report[0] == link.abs_buttons) {
+        // plain move: only the latest position matters, replace whatever is still waiting
+        link.abs.id = report_id::mouse_abs;
+        link.abs.len = 5;
+        memcpy(link.abs.data, report, 5);
+        link.abs_pending = true;
+        note_input(link.conn);
+        request_can_send_now(link);
+        return;
+    }
+
+    // button transition: the pointer has to get where the button changes first
+    if(link.abs_pending) {
+        link.abs_pending = false;
+        if(!link.queue.push(link.abs)) link.dropped++;
+    }
+    link.abs_buttons = report[0];
+
+    hid_report rpt;
+    rpt.id = report_id::mouse_abs;
+    rpt.len = 5;
+    memcpy(rpt.data, report, 5);
+    submit_to(link, rpt);
+}
+
+void bt::send_mouse_abs_report(uint8_t buttons, uint16_t x, uint16_t y) {
+    uint8_t report[5];
+    hid_mouse_abs_rpt_set(report, buttons, x, y);
+    bool any = for_each_target([&report](hid_link& l) {
+        submit_mouse_abs(l, report);
+    });
+    if(!any && log_enabled()) log("No target central, cannot send report");
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include "pico/stdlib.h"
 #include "model.h"
+#include <functional>
 
 // btstack
 #include "btstack.h"
@@ -9,11 +10,50 @@
 #include "ble/gatt-service/hids_device.h"
 #include "device.h" // generated from .gatt by GATT compiler
 #include "hid.h"
+#include "spsc_ring.h"
+
+// capacity of the outgoing HID report queue (must be a power of two)
+constexpr size_t HID_REPORT_QUEUE_SIZE = 32;
+
+// connection parameters requested while input is flowing: 7.5 - 15 ms, no slave latency
+constexpr uint16_t BT_CONN_FAST_INTERVAL_MIN = 6;     // 1.25 ms units
+constexpr uint16_t BT_CONN_FAST_INTERVAL_MAX = 12;
+constexpr uint16_t BT_CONN_FAST_LATENCY = 0;
+
+// connection parameters requested after the idle period: 60 - 90 ms, skip up to 4 events
+constexpr uint16_t BT_CONN_IDLE_INTERVAL_MIN = 48;
+constexpr uint16_t BT_CONN_IDLE_INTERVAL_MAX = 72;
+constexpr uint16_t BT_CONN_IDLE_LATENCY = 4;
+
+constexpr uint16_t BT_CONN_SUPERVISION_TIMEOUT = 300; // 10 ms units, 3 s
+
+// default time without input before the link is relaxed
+constexpr uint32_t BT_CONN_IDLE_MS = 15000;
+
+// Advertising runs in phases (see bt::adv_restart): directed at bonded centrals, so they reconnect within a
+// scan window, then fast undirected for new hosts and bonded ones on private addresses, then slow to save power.
+constexpr size_t BT_ADV_DIRECTED_MAX_TARGETS = 3;
+constexpr uint32_t BT_ADV_DIRECTED_MS = 400;        // per target, below the controller's 1.28 s limit for high duty cycle
+constexpr uint16_t BT_ADV_FAST_INTERVAL = 0x0020;   // 0.625 ms units, 20 ms
+constexpr uint32_t BT_ADV_FAST_MS = 30000;
+constexpr uint16_t BT_ADV_SLOW_INTERVAL = 0x029C;   // 417.5 ms
 
 class bt {
 public:
+    struct queue_stats {
+        uint32_t depth;       // reports waiting for CAN_SEND_NOW in the fullest target queue
+        uint32_t high_water;  // deepest the queue has been since boot
+        uint32_t overflows;   // reports dropped because a queue was full
+    };
+
     uint8_t battery = 95;
     app_state& as;
+
+    // time without input after which active links are relaxed to the idle connection parameters
+    uint32_t conn_idle_ms{BT_CONN_IDLE_MS};
+
+    // send every report to all ready centrals instead of just the current one
+    bool broadcast{false};
     static bt* g_bt;
 
     bt(app_state& as);
@@ -25,17 +65,40 @@ public:
         return is_advertising;
     }
     void adv_toggle();
+    // Starts the advertising phases over, if advertising is on: directed at each bonded central that isn't
+    // connected (preferred first), then fast, then slow. Called at power-on, after a connect and a disconnect.
+    void adv_restart();
     bool activate_central(uint16_t central_id);
     void unpair_central(uint16_t central_id);
+    void set_broadcast(bool on);
 
     void update_as();
+    void update_stats();
+    queue_stats hid_queue_stats() const;
+    // time since input last went to a central (or since boot)
+    uint32_t input_idle_ms() const;
 
     // HID utils
     void send_key_press(uint8_t keycode);
-    void send_key_report(const uint8_t report[8]);
+    bool send_key_report(const uint8_t report[8]);
     void send_mouse_report(const uint8_t report[4]);
+    // relative motion beyond +-127, sent with the 16-bit report (report mode) or split up (boot mode)
+    void send_mouse_wide_report(uint8_t buttons, int16_t dx, int16_t dy, int8_t wheel, int8_t pan);
+    // x and y in 0..HID_MOUSE_ABS_MAX, report mode only (boot protocol has no absolute mouse)
+    void send_mouse_abs_report(uint8_t buttons, uint16_t x, uint16_t y);
+
+    // Addressed variants: go to the given central only, regardless of the current central and broadcast.
+    bool send_key_report_to(uint16_t central_id, const uint8_t report[8]);
+    bool send_mouse_report_to(uint16_t central_id, const uint8_t report[4]);
+
+    // Called from the HIDS packet handler every time a queued report went out, so that producers
+    // such as the typing engine can top the queue up at the pace the link allows.
+    std::function<void()> on_report_sent;
+
+    // Called after bt changed app_state (centrals, advertising, broadcast), so it can be pushed out right away.
+    std::function<void()> on_state_change;
 
 private:
-    bool is_advertising{false};
+    bool is_advertising{true};
 
 };
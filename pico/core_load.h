@@ -0,0 +1,38 @@
+#pragma once
+#include "pico/stdlib.h"
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Time a core spent running our code, sampled into the utilization figures on the page.
+ * Core 0 counts the async context callbacks and tasks (cyw43 driver and stack internals in between
+ * are not seen), core 1 counts the typing engine.
+ * Each counter is only written by its own core.
+ */
+struct core_load {
+    std::atomic<uint32_t> busy_us{0};
+    uint32_t depth{0};  // busy_scope nesting on this core, only the outermost scope counts
+};
+
+inline core_load g_core_load[2];
+
+// Counts the time until the end of the scope as busy for the calling core.
+class busy_scope {
+public:
+    busy_scope() : c_(g_core_load[get_core_num()]) {
+        if (c_.depth++ == 0) t0_ = time_us_32();
+    }
+
+    ~busy_scope() {
+        if (--c_.depth == 0) {
+            c_.busy_us.store(c_.busy_us.load(std::memory_order_relaxed) + (time_us_32() - t0_), std::memory_order_relaxed);
+        }
+    }
+
+    busy_scope(const busy_scope&) = delete;
+    busy_scope& operator=(const busy_scope&) = delete;
+
+private:
+    core_load& c_;
+    uint32_t t0_{0};
+};
@@ -0,0 +1,50 @@
+#include "flash_page.h"
+#include "log.h"
+#include "pico/flash.h"
+
+namespace {
+
+flash_stats stats;
+
+struct flash_op {
+    uint32_t offset;
+    const uint8_t *page;  // nullptr: erase only
+    bool erase;
+};
+
+// runs with core 1 parked and interrupts disabled, must not touch flash contents itself
+void run_op(void *param) {
+    const flash_op& op = *static_cast<const flash_op*>(param);
+    if (op.erase) flash_range_erase(op.offset, FLASH_SECTOR_SIZE);
+    if (op.page) flash_range_program(op.offset, op.page, FLASH_PAGE_SIZE);
+}
+
+bool execute(const flash_op& op) {
+    // the lockout included: core 1 and interrupts are held from the start of the call to its end
+    uint32_t start = time_us_32();
+    int rc = flash_safe_execute(run_op, const_cast<flash_op*>(&op), 100);
+    uint32_t stall = time_us_32() - start;
+    stats.last_stall_us = stall;
+    if (stall > stats.max_stall_us) stats.max_stall_us = stall;
+    if (rc != PICO_OK) {
+        if (log_enabled()) log("flash: %s at 0x%x failed: %d", op.page ? "write" : "erase", (unsigned)op.offset, rc);
+        return false;
+    }
+    if (op.page) stats.programs++;
+    if (op.erase) stats.erases++;
+    return true;
+}
+
+} // namespace
+
+bool flash_page_program(uint32_t offset, const uint8_t page[FLASH_PAGE_SIZE]) {
+    return execute(flash_op{offset, page, false});
+}
+
+bool flash_sector_erase(uint32_t offset) {
+    return execute(flash_op{offset, nullptr, true});
+}
+
+const flash_stats& flash_get_stats() {
+    return stats;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "pico/stdlib.h"
+#include <hardware/flash.h>
+#include <cstdint>
+
+// Settings sectors, counted back from the end of flash. BTstack keeps its TLV bank (bonding keys)
+// in the last two sectors, see pico_btstack_flash_bank. The sector below held the Wi-Fi cache before
+// it moved into the store; it stays reserved so the store's sectors keep their place.
+constexpr uint32_t FLASH_WIFI_CACHE_OFFSET = PICO_FLASH_SIZE_BYTES - 3 * FLASH_SECTOR_SIZE;
+constexpr uint32_t FLASH_KV_SECTORS = 4;
+constexpr uint32_t FLASH_KV_OFFSET = FLASH_WIFI_CACHE_OFFSET - FLASH_KV_SECTORS * FLASH_SECTOR_SIZE;
+
+// Flash contents at offset (from the start of flash), read through XIP.
+template <typename T>
+const T* flash_page_read(uint32_t offset) {
+    return reinterpret_cast<const T*>(XIP_BASE + offset);
+}
+
+// Core 1 runs the typing engine straight from flash (XIP), so every erase and program must go through
+// the calls below: flash_range_erase/program with only this core's interrupts off would fault core 1.
+
+/**
+ * Programs one page at offset (page aligned) without erasing. Programming only clears bits, so bytes
+ * left 0xff in page keep what the flash holds: a page can be filled in several goes.
+ * Safe with both cores running: core 1 is parked in RAM (multicore lockout) and interrupts are off
+ * until the flash is readable again, same for flash_sector_erase().
+ * Returns false if core 1 could not be parked, nothing was written then.
+ */
+bool flash_page_program(uint32_t offset, const uint8_t page[FLASH_PAGE_SIZE]);
+
+bool flash_sector_erase(uint32_t offset);
+
+// Flash writes since boot and how long both cores were locked out for them.
+struct flash_stats {
+    uint32_t programs{0};     // page programs
+    uint32_t erases{0};       // sector erases
+    uint32_t last_stall_us{0};
+    uint32_t max_stall_us{0};
+};
+
+const flash_stats& flash_get_stats();
@@ -1,33 +1,65 @@
 #include "hid.h"
+#include "kv_store.h"
 #include <algorithm>
+#include <cstdlib>
 #include <cstring>
-#include <hardware/flash.h>
-#include <hardware/sync.h>
 
 using namespace std;
 
 namespace {
 
-constexpr uint32_t kPreferredCentralMagic = 0x43524448; // "HDRC"
-constexpr uint32_t kPreferredCentralVersion = 1;
-constexpr uint32_t kPreferredCentralFlashOffset = PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE;
+// Persisted in g_kv_store: the preferred central, the names centrals reported and, for centrals on resolvable
+// private addresses, the latest address each used, all keyed by identity address.
+const std::string kKeyPreferred = "pref";
+const std::string kKeyNamePrefix = "name/";
+const std::string kKeyAddrPrefix = "addr/";
+
+// Where the preferred central used to live, read to carry it over until the store has been written for the first
+// time. This sector belongs to BTstack's TLV bank.
+constexpr uint32_t kLegacyPreferredMagic = 0x43524448; // "HDRC"
+constexpr uint32_t kLegacyPreferredVersion = 1;
+constexpr uint32_t kLegacyPreferredOffset = PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE;
 constexpr size_t kBtAddrStringLength = 17;
 
-struct preferred_central_store {
+struct legacy_preferred_central {
     uint32_t magic;
     uint32_t version;
     char addr[kBtAddrStringLength + 1];
-    uint8_t reserved[FLASH_PAGE_SIZE - sizeof(uint32_t) * 2 - (kBtAddrStringLength + 1)];
 };
 
-static_assert(sizeof(preferred_central_store) == FLASH_PAGE_SIZE, "preferred central store must fit one flash page");
+bool is_valid_bt_addr(const std::string& addr) {
+    return !addr.empty() && addr.size() <= kBtAddrStringLength;
+}
 
-const preferred_central_store* preferred_central_flash() {
-    return reinterpret_cast<const preferred_central_store*>(XIP_BASE + kPreferredCentralFlashOffset);
+// Public and static random addresses stay with a device. Private ones (resolvable ones not resolved yet)
+// change every few minutes, nothing may be stored under them or the store fills up with stale keys.
+bool is_identity_addr(uint8_t addr_type, const std::string& addr) {
+    if (addr_type == BD_ADDR_TYPE_LE_PUBLIC) return true;
+    if (addr_type != BD_ADDR_TYPE_LE_RANDOM || addr.size() < 2) return false;
+    // the two top bits of the most significant byte, printed first: 11 static, 01 resolvable, 00 non-resolvable
+    return (strtoul(addr.substr(0, 2).c_str(), nullptr, 16) & 0xC0) == 0xC0;
 }
 
-bool is_valid_bt_addr(const std::string& addr) {
-    return !addr.empty() && addr.size() <= kBtAddrStringLength;
+// whether BTstack holds a bond for the identity address addr
+bool is_bonded(const std::string& addr) {
+    for (int i = 0; i < le_device_db_max_count(); i++) {
+        bd_addr_t db_addr;
+        int db_addr_type;
+        sm_key_t irk;
+        le_device_db_info(i, &db_addr_type, db_addr, irk);
+        if (db_addr_type != BD_ADDR_TYPE_UNKNOWN && bd_addr_to_str(db_addr) == addr) return true;
+    }
+    return false;
+}
+
+// name cut to what the store takes, at a character boundary
+std::string stored_name(const std::string& name) {
+    size_t len = name.size();
+    if (len > KV_MAX_VALUE) {
+        len = KV_MAX_VALUE;
+        while (len > 0 && (static_cast<uint8_t>(name[len]) & 0xC0) == 0x80) len--;
+    }
+    return name.substr(0, len);
 }
 
 } // namespace
@@ -35,8 +67,9 @@ bool is_valid_bt_addr(const std::string& addr) {
 std::vector<hid_central> hid_central::_centrals;
 std::map<std::string, std::string> hid_central::random_to_public_addr;
 std::map<std::string, std::string> hid_central::addr_to_user_name;
+std::vector<std::string> hid_central::stored_names;
 std::string hid_central::preferred_addr;
-bool hid_central::preferred_addr_loaded = false;
+bool hid_central::store_loaded = false;
 hid_central hid_central::cc;
 
 void hid_central::disconnect(hci_con_handle_t handle) {
@@ -51,7 +84,7 @@ void hid_central::disconnect(hci_con_handle_t handle) {
 }
 
 void hid_central::unpair(hci_con_handle_t handle) {
-    load_preferred_addr();
+    load_store();
     hid_central* c = find(handle);
     if (!c) return;
 
@@ -73,8 +106,14 @@ void hid_central::unpair(hci_con_handle_t handle) {
         }
     }
 
-    // remove cached name
+    // remove cached name and address mappings
     addr_to_user_name.erase(target_addr);
+    for (auto it = random_to_public_addr.begin(); it != random_to_public_addr.end();) {
+        it = it->second == target_addr ? random_to_public_addr.erase(it) : std::next(it);
+    }
+    stored_names.erase(std::remove(stored_names.begin(), stored_names.end(), target_addr), stored_names.end());
+    g_kv_store.erase(kKeyNamePrefix + target_addr);
+    g_kv_store.erase(kKeyAddrPrefix + target_addr);
 
     if (target_addr == preferred_addr) {
         clear_preferred_addr();
@@ -85,7 +124,7 @@ void hid_central::unpair(hci_con_handle_t handle) {
 }
 
 hid_central hid_central::connect(hci_con_handle_t handle, const bd_addr_t addr, uint8_t addr_type) {
-    load_preferred_addr();
+    load_store();
     string saddr = bd_addr_to_str(addr);
 
     // if address is random, try to resolve it to public address
@@ -114,7 +153,7 @@ hid_central hid_central::connect(hci_con_handle_t handle, const bd_addr_t addr,
     } else if (!cc) {
         cc = new_central;
         if (preferred_addr.empty()) {
-            store_preferred_addr(new_central.addr);
+            store_preferred_addr(new_central.addr, new_central.addr_t);
         }
     }
     return new_central;
@@ -132,6 +171,8 @@ void hid_central::set_name(hci_con_handle_t handle, const std::string& name) {
     if (!c) return;
     c->name = name;
     addr_to_user_name[c->addr] = name;
+    // under a private address the name stays in RAM, add_address_mapping() stores it once the identity is known
+    if (is_identity_addr(c->addr_t, c->addr)) store_name(c->addr, name);
     if (cc.conn == handle) cc.name = name;
 }
 
@@ -142,7 +183,7 @@ hid_central& hid_central::current() {
 void hid_central::current(hid_central central, bool persist_preference) {
     cc = central;
     if (persist_preference) {
-        store_preferred_addr(central.addr);
+        store_preferred_addr(central.addr, central.addr_t);
     }
 }
 
@@ -156,15 +197,61 @@ vector<hid_central>& hid_central::centrals() {
     return _centrals;
 }
 
+size_t hid_central::reconnect_targets(bond* out, size_t max) {
+    load_store();
+    size_t n = 0;
+    // preferred central in the first pass, the rest in the second
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < le_device_db_max_count() && n < max; i++) {
+            bond b;
+            int db_addr_type;
+            sm_key_t irk;
+            le_device_db_info(i, &db_addr_type, b.addr, irk);
+            if (db_addr_type == BD_ADDR_TYPE_UNKNOWN) continue;
+
+            std::string addr = bd_addr_to_str(b.addr);
+            if ((addr == preferred_addr) != (pass == 0)) continue;
+            bool connected = std::any_of(_centrals.begin(), _centrals.end(),
+                [&addr](const hid_central& hc) { return hc.addr == addr; });
+            if (connected) continue;
+
+            b.addr_type = (uint8_t)db_addr_type;
+            out[n++] = b;
+        }
+    }
+    return n;
+}
+
 void hid_central::add_address_mapping(const std::string& random_addr, const std::string& public_addr) {
-    load_preferred_addr();
+    load_store();
     random_to_public_addr[random_addr] = public_addr;
+    // only the latest one per central is kept, the host picks a new one every few minutes
+    g_kv_store.put(kKeyAddrPrefix + public_addr, random_addr);
+
+    // a name the central reported before it was resolved moves over to its identity
+    auto reported = addr_to_user_name.find(random_addr);
+    if (reported != addr_to_user_name.end()) {
+        std::string name = reported->second;
+        addr_to_user_name.erase(reported);
+        addr_to_user_name[public_addr] = name;
+        store_name(public_addr, name);
+    }
+
+    // so does a preference made while it was on the private address
+    if (preferred_addr == random_addr) {
+        preferred_addr.clear();
+        store_preferred_addr(public_addr, BD_ADDR_TYPE_LE_PUBLIC);
+    }
 
     // check if any existing central has this random address, and if so update it to use the public address
     for (auto& hc : _centrals) {
         if (hc.addr == random_addr) {
             hc.addr = public_addr;
             hc.addr_t = BD_ADDR_TYPE_LE_PUBLIC;
+            if (hc.name.empty()) {
+                auto name = addr_to_user_name.find(public_addr);
+                if (name != addr_to_user_name.end()) hc.name = name->second;
+            }
             if (cc.conn == hc.conn || (!preferred_addr.empty() && public_addr == preferred_addr)) {
                 cc = hc;
             }
@@ -172,8 +259,8 @@ void hid_central::add_address_mapping(const std::string& random_addr, const std:
     }
 }
 
-void hid_kbd_rpt_set_keycode(uint8_t* report, uint8_t keycode) {
-    report[0] = 0; // set modifier
+void hid_kbd_rpt_set_keycode(uint8_t* report, uint8_t keycode, uint8_t modifier) {
+    report[0] = modifier; // set modifier
     report[1] = 0; // reserved
     report[2] = keycode; // set keycode
     report[3] = 0; // reserved
@@ -183,6 +270,58 @@ void hid_kbd_rpt_set_keycode(uint8_t* report, uint8_t keycode) {
     report[7] = 0; // reserved
 }
 
+static int32_t take_clamped(int32_t& acc, int32_t limit) {
+    int32_t v = acc > limit ? limit : (acc < -limit ? -limit : acc);
+    acc -= v;
+    return v;
+}
+
+void hid_mouse_accumulator::add(int16_t dx, int16_t dy, int8_t wheel, int8_t pan) {
+    dx_ += dx;
+    dy_ += dy;
+    wheel_ += wheel;
+    pan_ += pan;
+}
+
+bool hid_mouse_accumulator::take(uint8_t* report, bool force) {
+    pan_ = 0;
+    if (!pending() && !force) return false;
+    report[0] = buttons_;
+    report[1] = static_cast<uint8_t>(take_clamped(dx_, 127));
+    report[2] = static_cast<uint8_t>(take_clamped(dy_, 127));
+    report[3] = static_cast<uint8_t>(take_clamped(wheel_, 127));
+    return true;
+}
+
+bool hid_mouse_accumulator::take_wide(uint8_t* report, bool force) {
+    if (!pending() && !force) return false;
+    uint16_t x = static_cast<uint16_t>(take_clamped(dx_, 32767));
+    uint16_t y = static_cast<uint16_t>(take_clamped(dy_, 32767));
+    report[0] = buttons_;
+    report[1] = x & 0xFF;
+    report[2] = x >> 8;
+    report[3] = y & 0xFF;
+    report[4] = y >> 8;
+    report[5] = static_cast<uint8_t>(take_clamped(wheel_, 127));
+    report[6] = static_cast<uint8_t>(take_clamped(pan_, 127));
+    return true;
+}
+
+void hid_mouse_accumulator::clear() {
+    dx_ = 0;
+    dy_ = 0;
+    wheel_ = 0;
+    pan_ = 0;
+}
+
+void hid_kbd_rpt_set_keys(uint8_t* report, uint8_t modifier, const uint8_t* keys, size_t count) {
+    report[0] = modifier;
+    report[1] = 0; // reserved
+    for (size_t i = 0; i < 6; i++) {
+        report[2 + i] = i < count ? keys[i] : 0;
+    }
+}
+
 void hid_kbd_rpt_mouse_up(uint8_t* report) {
     report[0] = 0; // buttons
     report[1] = 0; // X
@@ -190,6 +329,16 @@ void hid_kbd_rpt_mouse_up(uint8_t* report) {
     report[3] = 0; // wheel
 }
 
+void hid_mouse_abs_rpt_set(uint8_t* rpt, uint8_t buttons, uint16_t x, uint16_t y) {
+    if(x > HID_MOUSE_ABS_MAX) x = HID_MOUSE_ABS_MAX;
+    if(y > HID_MOUSE_ABS_MAX) y = HID_MOUSE_ABS_MAX;
+    rpt[0] = buttons;
+    rpt[1] = x & 0xFF;
+    rpt[2] = x >> 8;
+    rpt[3] = y & 0xFF;
+    rpt[4] = y >> 8;
+}
+
 std::string hid_central::addr_type_to_str(uint8_t addr_type) {
     switch(addr_type) {
         case BD_ADDR_TYPE_LE_PUBLIC: return "public";
@@ -238,26 +387,59 @@ void hid_central::refresh_irks() {
     }
 }
 
-void hid_central::load_preferred_addr() {
-    if (preferred_addr_loaded) return;
-    preferred_addr_loaded = true;
-    preferred_addr.clear();
-
-    const preferred_central_store* store = preferred_central_flash();
-    if (store->magic != kPreferredCentralMagic || store->version != kPreferredCentralVersion) {
-        return;
+void hid_central::load_store() {
+    if (store_loaded) return;
+    store_loaded = true;
+
+    const std::string* pref = g_kv_store.get(kKeyPreferred);
+    if (pref) {
+        preferred_addr = *pref;
+    } else if (g_kv_store.stats().generation == 0) {
+        // once the store has a sector, a missing preference was cleared on purpose and must stay cleared
+        const legacy_preferred_central* legacy = flash_page_read<legacy_preferred_central>(kLegacyPreferredOffset);
+        size_t len = strnlen(legacy->addr, sizeof(legacy->addr));
+        if (legacy->magic == kLegacyPreferredMagic && legacy->version == kLegacyPreferredVersion &&
+            len > 0 && len < sizeof(legacy->addr)) {
+            // carried over as it was stored, the old page kept no address type
+            store_preferred_addr(std::string(legacy->addr, len), BD_ADDR_TYPE_LE_PUBLIC);
+        }
     }
 
-    size_t len = strnlen(store->addr, sizeof(store->addr));
-    if (len == 0 || len >= sizeof(store->addr)) {
-        return;
-    }
+    // names and address mappings are there right away, before any GATT query or identity resolution
+    g_kv_store.for_each(kKeyNamePrefix, [](const std::string& addr, const std::string& name) {
+        addr_to_user_name[addr] = name;
+        stored_names.push_back(addr);
+    });
+    g_kv_store.for_each(kKeyAddrPrefix, [](const std::string& addr, const std::string& random_addr) {
+        random_to_public_addr[random_addr] = addr;
+    });
+}
 
-    preferred_addr.assign(store->addr, len);
+void hid_central::store_name(const std::string& addr, const std::string& name) {
+    load_store();
+    g_kv_store.put(kKeyNamePrefix + addr, stored_name(name));
+    stored_names.erase(std::remove(stored_names.begin(), stored_names.end(), addr), stored_names.end());
+    stored_names.push_back(addr);
+
+    // Bonds BTstack drops (to make room for a new one, or cleared on the host side) leave their names behind.
+    // Past one name per bond table slot, the oldest ones of centrals that are neither bonded nor connected go.
+    size_t max = (size_t)le_device_db_max_count();
+    for (auto it = stored_names.begin(); stored_names.size() > max && it != stored_names.end();) {
+        const std::string& stale = *it;
+        bool connected = std::any_of(_centrals.begin(), _centrals.end(),
+            [&stale](const hid_central& hc) { return hc.addr == stale; });
+        if (connected || is_bonded(stale)) {
+            ++it;
+            continue;
+        }
+        addr_to_user_name.erase(stale);
+        g_kv_store.erase(kKeyNamePrefix + stale);
+        it = stored_names.erase(it);
+    }
 }
 
-void hid_central::store_preferred_addr(const std::string& addr) {
-    load_preferred_addr();
+void hid_central::store_preferred_addr(const std::string& addr, uint8_t addr_type) {
+    load_store();
 
     if (!is_valid_bt_addr(addr)) {
         return;
@@ -266,41 +448,29 @@ void hid_central::store_preferred_addr(const std::string& addr) {
         return;
     }
 
-    preferred_central_store page{};
-    memset(&page, 0xFF, sizeof(page));
-    page.magic = kPreferredCentralMagic;
-    page.version = kPreferredCentralVersion;
-    memcpy(page.addr, addr.c_str(), addr.size());
-    page.addr[addr.size()] = '\0';
-
-    uint32_t interrupts = save_and_disable_interrupts();
-    flash_range_erase(kPreferredCentralFlashOffset, FLASH_SECTOR_SIZE);
-    flash_range_program(kPreferredCentralFlashOffset, reinterpret_cast<const uint8_t*>(&page), sizeof(page));
-    restore_interrupts(interrupts);
-
     preferred_addr = addr;
+    if (is_identity_addr(addr_type, addr)) {
+        g_kv_store.put(kKeyPreferred, addr);
+    } else {
+        // under a private address the preference stays in RAM, add_address_mapping() stores it once the identity
+        // is known. The stored one is outdated either way.
+        g_kv_store.erase(kKeyPreferred);
+    }
 }
 
 void hid_central::clear_preferred_addr() {
-    load_preferred_addr();
+    load_store();
 
     if (preferred_addr.empty()) {
         return;
     }
 
-    uint8_t erased_page[FLASH_PAGE_SIZE];
-    memset(erased_page, 0xFF, sizeof(erased_page));
-
-    uint32_t interrupts = save_and_disable_interrupts();
-    flash_range_erase(kPreferredCentralFlashOffset, FLASH_SECTOR_SIZE);
-    flash_range_program(kPreferredCentralFlashOffset, erased_page, sizeof(erased_page));
-    restore_interrupts(interrupts);
-
     preferred_addr.clear();
+    g_kv_store.erase(kKeyPreferred);
 }
 
 void hid_central::select_current_after_change() {
-    load_preferred_addr();
+    load_store();
 
     if (_centrals.empty()) {
         cc = hid_central();
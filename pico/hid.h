@@ -103,43 +103,159 @@ static const uint8_t HidReportMap[] = {
         0xC0,        //   End Collection
     0xC0,        // End Collection
 
+    // --- Mouse with 16-bit motion ---
+    // 7 bytes: 1 byte buttons, 2 bytes X, 2 bytes Y, 1 byte wheel, 1 byte horizontal pan
+    // same pointer as report 2, but a fast flick fits one report instead of being cut into +-127 steps
+
+    0x05, 0x01,  // Usage Page (Generic Desktop)
+    0x09, 0x02,  // Usage (Mouse)
+    0xA1, 0x01,  // Collection (Application)
+        0x85, 0x06,  // Report Id (6)
+        0x09, 0x01,  // Usage (Pointer)
+        0xA1, 0x00,  // Collection (Physical)
+
+            // 3 buttons (1 bit each) padded with 5 bits - 1 byte total
+            0x05, 0x09,  // Usage Page (Buttons)
+            0x19, 0x01,  // Usage Minimum (01) - Button 1
+            0x29, 0x03,  // Usage Maximum (03) - Button 3
+            0x15, 0x00,  // Logical Minimum (0)
+            0x25, 0x01,  // Logical Maximum (1)
+            0x75, 0x01,  // Report Size (1)
+            0x95, 0x03,  // Report Count (3)
+            0x81, 0x02,  // Input (Data, Variable, Absolute) - Button states
+            0x75, 0x05,  // Report Size (5)
+            0x95, 0x01,  // Report Count (1)
+            0x81, 0x01,  // Input (Constant) - Padding or Reserved bits
+
+            // X and Y movement, 2 bytes each
+            0x05, 0x01,        // Usage Page (Generic Desktop)
+            0x09, 0x30,        // Usage (X)
+            0x09, 0x31,        // Usage (Y)
+            0x16, 0x01, 0x80,  // Logical Minimum (-32767)
+            0x26, 0xFF, 0x7F,  // Logical Maximum (32767)
+            0x75, 0x10,        // Report Size (16)
+            0x95, 0x02,        // Report Count (2)
+            0x81, 0x06,        // Input (Data, Variable, Relative) - X & Y
+
+            // vertical wheel, 1 byte
+            0x09, 0x38,  // Usage (Wheel)
+            0x15, 0x81,  // Logical Minimum (-127)
+            0x25, 0x7F,  // Logical Maximum (127)
+            0x75, 0x08,  // Report Size (8)
+            0x95, 0x01,  // Report Count (1)
+            0x81, 0x06,  // Input (Data, Variable, Relative) - Wheel
+
+            // horizontal wheel, 1 byte
+            0x05, 0x0C,        // Usage Page (Consumer)
+            0x0A, 0x38, 0x02,  // Usage (AC Pan)
+            0x15, 0x81,        // Logical Minimum (-127)
+            0x25, 0x7F,        // Logical Maximum (127)
+            0x75, 0x08,        // Report Size (8)
+            0x95, 0x01,        // Report Count (1)
+            0x81, 0x06,        // Input (Data, Variable, Relative) - Pan
+
+        0xC0,        //   End Collection
+    0xC0,        // End Collection
+
     // --- Mouse with Absolute Positioning ---
     // we want mouse report to be 5 bytes long (1 byte for buttons, 2 bytes for X, 2 bytes for Y)
-    // 0x05, 0x01,  // Usage Page (Generic Desktop)
-    // 0x09, 0x02,  // Usage (Mouse)
-    // 0xA1, 0x01,  // Collection (Application)
-    //     0x85, 0x05,  // Report Id (5)
-    //     0x09, 0x01,  // Usage (Pointer)
-    //     0xA1, 0x00,  // Collection (Physical)
-
-    //         // 3 buttons (1 bit each) padded with 5 bits - 1 byte total
-    //         0x05, 0x09,  // Usage Page (Buttons)
-    //         0x19, 0x01,  // Usage Minimum (01) - Button 1
-    //         0x29, 0x03,  // Usage Maximum (03) - Button 3
-    //         0x15, 0x00,  // Logical Minimum (0)
-    //         0x25, 0x01,  // Logical Maximum (1)
-    //         0x75, 0x01,  // Report Size (1)
-    //         0x95, 0x03,  // Report Count (3)
-    //         0x81, 0x02,  // Input (Data, Variable, Absolute) - Button states
-    //         0x75, 0x05,  // Report Size (5)
-    //         0x95, 0x01,  // Report Count (1)
-    //         0x81, 0x01,  // Input (Constant) - Padding or Reserved bits
-
-    //         // absolute X, Y, 2 bytes each
-    //         0x05, 0x01,  // Usage Page (Generic Desktop)
-    //         0x09, 0x30,  // Usage (X)
-    //         0x09, 0x31,  // Usage (Y)
-    //         0x15, 0x00,        // Logical Minimum (0)
-    //         0x26, 0xFF, 0x03,  // Logical Maximum (1023)
-    //         0x75, 0x10,        // Report Size (16)
-    //         0x95, 0x02,        // Report Count (2)
-    //         0x81, 0x02,        // Input (Data, Variable, Absolute) - Absolute position
-    //     0xC0,        //   End Collection
-    // 0xC0,        // End Collection
+    // X and Y span the whole screen, 0..32767 regardless of its resolution
+    0x05, 0x01,  // Usage Page (Generic Desktop)
+    0x09, 0x02,  // Usage (Mouse)
+    0xA1, 0x01,  // Collection (Application)
+        0x85, 0x05,  // Report Id (5)
+        0x09, 0x01,  // Usage (Pointer)
+        0xA1, 0x00,  // Collection (Physical)
+
+            // 3 buttons (1 bit each) padded with 5 bits - 1 byte total
+            0x05, 0x09,  // Usage Page (Buttons)
+            0x19, 0x01,  // Usage Minimum (01) - Button 1
+            0x29, 0x03,  // Usage Maximum (03) - Button 3
+            0x15, 0x00,  // Logical Minimum (0)
+            0x25, 0x01,  // Logical Maximum (1)
+            0x75, 0x01,  // Report Size (1)
+            0x95, 0x03,  // Report Count (3)
+            0x81, 0x02,  // Input (Data, Variable, Absolute) - Button states
+            0x75, 0x05,  // Report Size (5)
+            0x95, 0x01,  // Report Count (1)
+            0x81, 0x01,  // Input (Constant) - Padding or Reserved bits
+
+            // absolute X, Y, 2 bytes each
+            0x05, 0x01,  // Usage Page (Generic Desktop)
+            0x09, 0x30,  // Usage (X)
+            0x09, 0x31,  // Usage (Y)
+            0x15, 0x00,        // Logical Minimum (0)
+            0x26, 0xFF, 0x7F,  // Logical Maximum (32767)
+            0x75, 0x10,        // Report Size (16)
+            0x95, 0x02,        // Report Count (2)
+            0x81, 0x02,        // Input (Data, Variable, Absolute) - Absolute position
+        0xC0,        //   End Collection
+    0xC0,        // End Collection
+};
+
+//report IDs for the different HID reports.
+//must correspond to the HID report map!
+enum class report_id : uint16_t {
+    none = 0,
+    kbd = 1,
+    mouse = 2,
+    mouse_abs = 5,
+    mouse_wide = 6
+};
+
+// absolute mouse coordinates run 0..HID_MOUSE_ABS_MAX on both axes, must match the report map
+constexpr uint16_t HID_MOUSE_ABS_MAX = 32767;
+
+// largest input report in the report map (keyboard, 8 bytes; the 16-bit mouse needs 7)
+constexpr size_t HID_REPORT_MAX_SIZE = 8;
+
+/**
+ * A fully copied input report, tagged with its report id, as it sits in the send queue.
+ */
+struct hid_report {
+    report_id id{report_id::none};
+    uint8_t len{0};
+    uint8_t data[HID_REPORT_MAX_SIZE];
+};
+
+/**
+ * Sums relative mouse motion (X, Y, wheel, pan) between connection events, so no delta is lost while a
+ * mouse report waits for CAN_SEND_NOW. Totals beyond the range of a single report are split over as
+ * many reports as needed. Button state is tracked so that transitions can be sent as reports of their own.
+ */
+class hid_mouse_accumulator {
+public:
+    uint8_t buttons() const { return buttons_; }
+    void buttons(uint8_t b) { buttons_ = b; }
+    bool pending() const { return dx_ != 0 || dy_ != 0 || wheel_ != 0 || pan_ != 0; }
+
+    void add(int16_t dx, int16_t dy, int8_t wheel, int8_t pan = 0);
+
+    /**
+     * Moves the next chunk of accumulated motion into a 4-byte mouse report (report id 2 / boot mouse).
+     * That report has no pan, so pending pan is dropped.
+     * Returns false (and leaves the report untouched) when there is nothing to send, unless force is
+     * set, then a report without motion is filled in (e.g. for a button transition).
+     */
+    bool take(uint8_t* rpt, bool force = false);
+
+    // Same as take(), for the 7-byte report with 16-bit X/Y and pan (report id 6).
+    bool take_wide(uint8_t* rpt, bool force = false);
+
+    void clear();
+
+private:
+    uint8_t buttons_{0};
+    int32_t dx_{0};
+    int32_t dy_{0};
+    int32_t wheel_{0};
+    int32_t pan_{0};
 };
 
-void hid_kbd_rpt_set_keycode(uint8_t* rpt, uint8_t keycode);
+void hid_kbd_rpt_set_keycode(uint8_t* rpt, uint8_t keycode, uint8_t modifier = 0);
+void hid_kbd_rpt_set_keys(uint8_t* rpt, uint8_t modifier, const uint8_t* keys, size_t count);
 void hid_kbd_rpt_mouse_up(uint8_t* rpt);
+void hid_mouse_abs_rpt_set(uint8_t* rpt, uint8_t buttons, uint16_t x, uint16_t y);
 
 class hid_central {
     public:
@@ -157,6 +273,25 @@ class hid_central {
         std::string irk; // Identity Resolving Key, used for resolving random addresses
         name_query_state nq_state{name_query_state::idle};
 
+        // connection parameters we last asked this central for
+        enum class conn_params_state : uint8_t {
+            host,     // whatever the central picked, nothing requested yet
+            fast,     // short interval while input is flowing
+            relaxed,  // long interval with slave latency while idle
+        };
+
+        // negotiated connection parameters (interval in 1.25 ms units, timeout in 10 ms units)
+        uint16_t conn_interval{0};
+        uint16_t conn_latency{0};
+        uint16_t supervision_timeout{0};
+        conn_params_state cp_state{conn_params_state::host};
+
+        // identity address of a bonded central (from le_device_db)
+        struct bond {
+            bd_addr_t addr;
+            uint8_t addr_type;
+        };
+
         operator bool() const { return conn != HCI_CON_HANDLE_INVALID; }
 
         // globals
@@ -176,6 +311,12 @@ class hid_central {
         }
         static std::vector<hid_central>& centrals();
 
+        /**
+         * Bonded centrals that are not connected right now, the preferred one first, at most max of them.
+         * Returns how many were written to out.
+         */
+        static size_t reconnect_targets(bond* out, size_t max);
+
         static void add_address_mapping(const std::string& random_addr, const std::string& public_addr);
         static void set_name(hci_con_handle_t handle, const std::string& name);
 
@@ -190,15 +331,19 @@ class hid_central {
         static std::vector<hid_central> _centrals;
         static std::map<std::string, std::string> random_to_public_addr;
         static std::map<std::string, std::string> addr_to_user_name;
+        // identity addresses with a name in g_kv_store, oldest first (the ones loaded at boot in key order)
+        static std::vector<std::string> stored_names;
         static std::string preferred_addr;
-        static bool preferred_addr_loaded;
+        static bool store_loaded;
 
         /**
          * Iterates through instances and refreshes IRKs for all devices using device db;
          */
         static void refresh_irks();
-        static void load_preferred_addr();
-        static void store_preferred_addr(const std::string& addr);
+        // preferred central, names and address mappings from g_kv_store, on first use
+        static void load_store();
+        static void store_name(const std::string& addr, const std::string& name);
+        static void store_preferred_addr(const std::string& addr, uint8_t addr_type);
         static void clear_preferred_addr();
         static void select_current_after_change();
 };
\ No newline at end of file
@@ -1,12 +1,15 @@
 #include "httpd.h"
+#include "kv_store.h"
 #include "log.h"
 #include "secrets.h"
 
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
+#include <string.h>
 
 // lwip
 #include "lwip/ip4_addr.h"
+#include "lwip/dhcp.h"
 #include "lwip/apps/mdns.h"
 #include "lwip/init.h"
 #include "lwip/apps/httpd.h"
@@ -15,6 +18,35 @@ using namespace std;
 
 httpd* httpd::g_httpd{nullptr};
 
+namespace {
+
+// g_kv_store key of the Wi-Fi cache, the value is a wifi_cache_store
+const std::string kKeyWifiCache = "wifi";
+
+// Access point and address of the last good join, only used for the SSID it was made with.
+struct wifi_cache_store {
+    uint32_t ip;  // ip4_addr_t values, network byte order
+    uint32_t netmask;
+    uint32_t gw;
+    uint8_t bssid[6];
+    uint8_t channel;
+    char ssid[33];
+};
+
+static_assert(sizeof(wifi_cache_store) <= KV_MAX_VALUE, "Wi-Fi cache must fit a store value");
+
+// The cache if it's there and made for WIFI_SSID, nullptr otherwise.
+const wifi_cache_store* wifi_cache() {
+    static wifi_cache_store c;
+    const std::string* v = g_kv_store.get(kKeyWifiCache);
+    if (!v || v->size() != sizeof(c)) return nullptr;
+    memcpy(&c, v->data(), sizeof(c));
+    if (strncmp(c.ssid, WIFI_SSID, sizeof(c.ssid)) != 0 || c.ip == 0) return nullptr;
+    return &c;
+}
+
+} // namespace
+
 // ---- Binary command protocol (browser -> device) ----
 // Frame layout: [CMD: u8] [payload...]
 enum : uint8_t {
@@ -25,12 +57,69 @@ enum : uint8_t {
     CMD_BT_CENTRAL_UNPAIR = 0x05,  // u16le: central_id
     CMD_TYPE              = 0x06,  // u16le: len, then len bytes UTF-8
     CMD_REBOOT            = 0x07,  // no payload
+    CMD_TYPE_CANCEL       = 0x08,  // no payload
+    CMD_SET_LAYOUT        = 0x09,  // u8: keyboard layout id (0 us, 1 uk, 2 de, 3 fr)
+    CMD_SET_TYPE_MODE     = 0x0A,  // u8: 0 single key per report, 1 rollover (up to 6 keys per report)
+    CMD_BT_BROADCAST      = 0x0B,  // u8: 0 send to current central, 1 send to all centrals
+    CMD_KBD_REPORT_TO     = 0x0C,  // u16le: central_id, then 8 bytes HID keyboard report
+    CMD_MOUSE_TO          = 0x0D,  // u16le: central_id, then 4 bytes like CMD_MOUSE
+    CMD_MOUSE_ABS         = 0x0E,  // buttons(u8), x(u16le), y(u16le); 0..32767 across the screen
+    CMD_MOUSE_WIDE        = 0x0F,  // buttons(u8), dx(i16le), dy(i16le), wheel(i8), pan(i8)
+    CMD_BATCH             = 0x10,  // repeated: len(u8), then len bytes of one command frame (no nested batches)
+    CMD_GET_STATE         = 0x11,  // no payload, full state is sent back (after a missed delta)
+    CMD_SET_STATUS_FORMAT = 0x12,  // u8: 0 JSON text (default), 1 binary status frames, full state is sent back
+};
+
+// Status format of a client, kept as its ws_server group
+enum : uint8_t {
+    STATUS_JSON   = 0,  // full state and deltas as JSON text frames
+    STATUS_BINARY = 1,  // full state as binary status frames, see write_status_frame
+};
+
+// First byte of a binary frame (device -> browser)
+enum : uint8_t {
+    BIN_STATUS = 0x01,
+};
+
+// ws_server::send keys, frames with the same key supersede each other
+enum : uint8_t {
+    WS_KEY_STATE = 1,   // full state
+    WS_KEY_UPTIME = 2,  // heartbeat
 };
 
 static uint16_t rd_u16le(const uint8_t *b) {
     return (uint16_t)(b[0] | (b[1] << 8));
 }
 
+static void wr_u16le(uint8_t *b, uint16_t v) {
+    b[0] = (uint8_t)v;
+    b[1] = (uint8_t)(v >> 8);
+}
+
+static void wr_u32le(uint8_t *b, uint32_t v) {
+    b[0] = (uint8_t)v;
+    b[1] = (uint8_t)(v >> 8);
+    b[2] = (uint8_t)(v >> 16);
+    b[3] = (uint8_t)(v >> 24);
+}
+
+static const char* adv_phase_str(app_adv_phase p) {
+    switch (p) {
+        case app_adv_phase::off: return "off";
+        case app_adv_phase::directed: return "directed";
+        case app_adv_phase::fast: return "fast";
+        case app_adv_phase::slow: return "slow";
+    }
+    return "unknown";
+}
+
+static uint8_t hex_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0;
+}
+
 // ---- httpd ----
 
 void httpd::init() {
@@ -40,121 +129,653 @@ void httpd::init() {
 
 void httpd::connect() {
     connection_attempts++;
-    if (log_enabled()) log("Connecting to Wi-Fi: %s, attempt %d", WIFI_SSID, connection_attempts);
-    int result = cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 30000);
-    if (result != 0) {
-        string reason = (result == PICO_ERROR_TIMEOUT)       ? "timeout" :
-                        (result == PICO_ERROR_BADAUTH)        ? "bad auth" :
-                        (result == PICO_ERROR_CONNECT_FAILED) ? "conn failed" :
-                        "unknown";
-        if (log_enabled()) log("Wi-Fi failed: %d (%s)", result, reason.c_str());
+    connect_started = get_absolute_time();
+    address_set = false;
+    cache_checked = false;
+
+    const wifi_cache_store* c = try_cache ? wifi_cache() : nullptr;
+    fast_join = c != nullptr;
+    int result;
+    if (fast_join) {
+        if (log_enabled()) log("Connecting to Wi-Fi: %s via %02x:%02x:%02x:%02x:%02x:%02x on channel %u, attempt %d", WIFI_SSID,
+                               c->bssid[0], c->bssid[1], c->bssid[2], c->bssid[3], c->bssid[4], c->bssid[5], c->channel,
+                               connection_attempts);
+        // cyw43_arch_wifi_connect_bssid_async() plus the channel, so the chip doesn't scan at all
+        result = cyw43_wifi_join(&cyw43_state, strlen(WIFI_SSID), reinterpret_cast<const uint8_t*>(WIFI_SSID),
+                                 strlen(WIFI_PASSWORD), reinterpret_cast<const uint8_t*>(WIFI_PASSWORD),
+                                 CYW43_AUTH_WPA2_AES_PSK, c->bssid, c->channel);
+    } else {
+        if (log_enabled()) log("Connecting to Wi-Fi: %s, attempt %d", WIFI_SSID, connection_attempts);
+        result = cyw43_arch_wifi_connect_async(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK);
+    }
+    if (result != 0 && log_enabled()) log("Wi-Fi join not started: %d", result);
+}
+
+void httpd::supervise() {
+    if (is_connected) {
+        watch_link();
+        return;
+    }
+    if (retry_pending) {
+        if (absolute_time_diff_us(get_absolute_time(), retry_at) > 0) return;
+        retry_pending = false;
+        connect();
         return;
     }
-    ip4addr = ip4addr_ntoa(netif_ip4_addr(netif_list));
-    if (log_enabled()) log("Wi-Fi connected, IP: %s", ip4addr.c_str());
+
+    int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+    if (status == CYW43_LINK_NOIP && !address_set) {
+        set_address();
+        status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+    }
+    if (status != CYW43_LINK_UP) {
+        uint32_t timeout_ms = fast_join ? HTTPD_FAST_JOIN_TIMEOUT_MS : HTTPD_CONNECT_TIMEOUT_MS;
+        bool timed_out = absolute_time_diff_us(connect_started, get_absolute_time()) >= (int64_t)timeout_ms * 1000;
+        if (status >= 0 && !timed_out) return;  // still joining or waiting for DHCP
+        string reason = timed_out                      ? "timeout" :
+                        (status == CYW43_LINK_BADAUTH) ? "bad auth" :
+                        (status == CYW43_LINK_NONET)   ? "no network" :
+                        "conn failed";
+        if (log_enabled()) log("Wi-Fi failed: %d (%s)", status, reason.c_str());
+        // a timed out join may still be associating or waiting for DHCP, the next one starts from scratch
+        cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+        if (fast_join) {
+            // the access point may have moved or changed channel, scan right away and from now on
+            try_cache = false;
+            connect();
+        } else {
+            retry_later();
+        }
+        return;
+    }
+
+    joined();
+}
+
+void httpd::joined() {
+    update_ip();
+    if (log_enabled()) log("Wi-Fi connected%s, IP: %s", fast_join ? " to the cached access point" : "", ip4addr.c_str());
     is_connected = true;
-    start_time = get_absolute_time();
+    try_cache = true;
+    backoff_ms = HTTPD_RETRY_MIN_MS;
+    if (!servers_started) {
+        start_time = get_absolute_time();
+        as.boot_wifi_ms = to_ms_since_boot(start_time);
+        as.boot_wifi_fast = fast_join;
+    } else {
+        uint32_t ms = (uint32_t)(absolute_time_diff_us(link.down_since, get_absolute_time()) / 1000);
+        link.last_outage_ms = ms;
+        if (ms > link.max_outage_ms) link.max_outage_ms = ms;
+        link.total_outage_ms += ms;
+        if (log_enabled()) log("Wi-Fi back after %u ms", ms);
+    }
+    start();
+    as.mark(APP_DIRTY_STATS);
+    update_wifi_cache();
+}
+
+// While connected: notices a lost link, finishes the address cache and makes sure the WebSocket server listens.
+void httpd::watch_link() {
+    int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+    if (status != CYW43_LINK_UP) {
+        if (log_enabled()) log("Wi-Fi link lost: %d, reconnecting", status);
+        is_connected = false;
+        link.outages++;
+        link.down_since = get_absolute_time();
+        // the clients' TCP connections died with the link, free their slots for when they come back
+        cyw43_arch_lwip_begin();
+        ws.drop_clients();
+        cyw43_arch_lwip_end();
+        // still associated if only the address went, drop that before joining again
+        cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+        connect();
+        return;
+    }
+
+    // serving on the cached lease, until DHCP confirms or replaces it
+    if (!cache_checked) update_wifi_cache();
+
+    if (!ws.listening() && absolute_time_diff_us(get_absolute_time(), listen_retry_at) <= 0) {
+        listen_retry_at = make_timeout_time_ms(HTTPD_RETRY_MIN_MS);
+        start();
+    }
+}
+
+// Backs off after a failed join: the next attempt waits twice as long as the previous one, up to HTTPD_RETRY_MAX_MS.
+void httpd::retry_later() {
+    if (log_enabled()) log("Wi-Fi: next attempt in %u ms", backoff_ms);
+    retry_at = make_timeout_time_ms(backoff_ms);
+    retry_pending = true;
+    backoff_ms = backoff_ms * 2 < HTTPD_RETRY_MAX_MS ? backoff_ms * 2 : HTTPD_RETRY_MAX_MS;
+}
+
+// Joined without an address yet: takes WIFI_STATIC_IP, or the cached lease after a fast join instead of waiting for DHCP.
+void httpd::set_address() {
+    address_set = true;
+    ip4_addr_t ip, netmask, gw;
+#ifdef WIFI_STATIC_IP
+    ip4addr_aton(WIFI_STATIC_IP, &ip);
+    ip4addr_aton(WIFI_STATIC_NETMASK, &netmask);
+    ip4addr_aton(WIFI_STATIC_GW, &gw);
+    dhcp_stop(netif_list);
+#else
+    const wifi_cache_store* c = fast_join ? wifi_cache() : nullptr;
+    if (!c) return;
+    ip4_addr_set_u32(&ip, c->ip);
+    ip4_addr_set_u32(&netmask, c->netmask);
+    ip4_addr_set_u32(&gw, c->gw);
+    // DHCP keeps going, and moves the address should the server hand out another one
+#endif
+    netif_set_addr(netif_list, &ip, &netmask, &gw);
+}
+
+void httpd::update_ip() {
+    const ip4_addr_t *addr = netif_ip4_addr(netif_list);
+    ip4addr = ip4addr_ntoa(addr);
+    ip4[0] = ip4_addr1(addr);
+    ip4[1] = ip4_addr2(addr);
+    ip4[2] = ip4_addr3(addr);
+    ip4[3] = ip4_addr4(addr);
+}
+
+// Once the address is final, remembers access point, channel and lease for the next join. The store only
+// queues a change when they did, and writes it with the other settings in the next idle window.
+void httpd::update_wifi_cache() {
+    struct netif *n = netif_list;
+#ifndef WIFI_STATIC_IP
+    if (!dhcp_supplied_address(n)) return;
+#endif
+    cache_checked = true;
+
+    const ip4_addr_t *addr = netif_ip4_addr(n);
+    if (ip4_addr1(addr) != ip4[0] || ip4_addr2(addr) != ip4[1] || ip4_addr3(addr) != ip4[2] || ip4_addr4(addr) != ip4[3]) {
+        update_ip();
+        if (log_enabled()) log("Wi-Fi address changed by DHCP, IP: %s", ip4addr.c_str());
+        as.mark(APP_DIRTY_STATS);
+    }
+
+    wifi_cache_store page;
+    memset(&page, 0, sizeof(page));
+    strncpy(page.ssid, WIFI_SSID, sizeof(page.ssid) - 1);
+    uint8_t channel[12];  // channel_info_t: hw_channel, target_channel, scan_channel (u32 each)
+    if (cyw43_wifi_get_bssid(&cyw43_state, page.bssid) != 0 ||
+        cyw43_ioctl(&cyw43_state, CYW43_IOCTL_GET_CHANNEL, sizeof(channel), channel, CYW43_ITF_STA) != 0) {
+        if (log_enabled()) log("Wi-Fi: access point unknown, not cached");
+        return;
+    }
+    page.channel = channel[0];
+    page.ip = ip4_addr_get_u32(addr);
+    page.netmask = ip4_addr_get_u32(netif_ip4_netmask(n));
+    page.gw = ip4_addr_get_u32(netif_ip4_gw(n));
+
+    std::string value(reinterpret_cast<const char*>(&page), sizeof(page));
+    const std::string* cached = g_kv_store.get(kKeyWifiCache);
+    if (cached && *cached == value) return;
+    if (log_enabled()) log("Wi-Fi: caching access point and lease");
+    g_kv_store.put(kKeyWifiCache, value);
 }
 
 void httpd::start() {
     cyw43_arch_lwip_begin();
 
-    // Serve static files (index.html) on port 80
-    httpd_init();
+    if (!servers_started) {
+        servers_started = true;
 
-    // WebSocket server on port 81
-    ws.init(81);
-    ws.on_message = [](const string& msg) {
-        httpd& h = *httpd::g_httpd;
+        // Serve static files (index.html) on port 80
+        httpd_init();
 
         // Send current state to a newly connected client
-        if (msg == "__connected__") {
-            h.notify();
-            return;
-        }
+        ws.on_connected = [](uint8_t) {
+            httpd::g_httpd->notify();
+        };
+
+        ws.on_message = [](uint8_t client, const uint8_t *b, size_t len) {
+            httpd& h = *httpd::g_httpd;
+            if (len < 1) return;
+            if (log_enabled()) log("WS rx cmd=0x%02x len=%u", b[0], (unsigned)len);
 
-        if (msg.size() < 1) return;
-        const uint8_t *b = (const uint8_t*)msg.data();
-        uint8_t cmd = b[0];
-        size_t  len = msg.size();
-
-        if (log_enabled()) log("WS rx cmd=0x%02x len=%u", cmd, (unsigned)len);
-        h.as.bt_centrals_json_array.clear();  // invalidate cache before notify
-
-        switch (cmd) {
-            case CMD_KBD_REPORT:
-                if (len >= 9 && h.cmd_kbd_report)
-                    h.cmd_kbd_report(b + 1);
-                return;  // high-frequency, no state notify
-            case CMD_MOUSE:
-                if (len >= 5 && h.cmd_mouse_report)
-                    h.cmd_mouse_report(b + 1);
-                return;  // high-frequency, no state notify
-            case CMD_BT_ADV_TOGGLE:
-                if (h.cmd_bt_adv_toggle) h.cmd_bt_adv_toggle();
-                break;
-            case CMD_BT_CENTRAL_ACT:
-                if (len >= 3 && h.cmd_bt_central_activate)
-                    h.cmd_bt_central_activate(rd_u16le(b + 1));
-                break;
-            case CMD_BT_CENTRAL_UNPAIR:
-                if (len >= 3 && h.cmd_bt_central_unpair)
-                    h.cmd_bt_central_unpair(rd_u16le(b + 1));
-                break;
-            case CMD_TYPE: {
-                if (len >= 3) {
-                    uint16_t tlen = rd_u16le(b + 1);
-                    if (log_enabled()) log("CMD_TYPE: msg_len=%u text_len=%u", (unsigned)len, (unsigned)tlen);
-                    if (len >= (size_t)(3 + tlen) && h.cmd_type) {
-                        string text((const char*)(b + 3), tlen);
-                        if (log_enabled()) log("Sending text: %s", text.c_str());
-                        h.cmd_type(text);
-                    }
+            uint32_t t0 = time_us_32();
+            bool changed = (b[0] == CMD_BATCH) ? h.handle_batch(client, b + 1, len - 1) : h.handle_command(client, b, len);
+            h.stats.busy_us += time_us_32() - t0;
+            h.stats.frames++;
+
+            if (changed) h.notify_changes();
+        };
+    }
+
+    // WebSocket server on port 81. Listening survives a lost link, this only has work to do
+    // if the listener couldn't be set up before (no PCB to spare).
+    if (!ws.listening() && ws.init(81) && as.boot_ws_ms == 0) {
+        as.boot_ws_ms = to_ms_since_boot(get_absolute_time());
+    }
+
+    cyw43_arch_lwip_end();
+}
+
+// Runs one command frame. Returns true if the device state changed and clients should be notified.
+bool httpd::handle_command(uint8_t client, const uint8_t *b, size_t len) {
+    uint8_t cmd = b[0];
+    stats.cmds++;
+
+    switch (cmd) {
+        case CMD_KBD_REPORT:
+            if (len >= 9 && cmd_kbd_report)
+                cmd_kbd_report(b + 1);
+            return false;  // high-frequency, no state notify
+        case CMD_MOUSE:
+            if (len >= 5 && cmd_mouse_report)
+                cmd_mouse_report(b + 1);
+            return false;  // high-frequency, no state notify
+        case CMD_MOUSE_WIDE:
+            if (len >= 8 && cmd_mouse_wide)
+                cmd_mouse_wide(b[1], (int16_t)rd_u16le(b + 2), (int16_t)rd_u16le(b + 4), (int8_t)b[6], (int8_t)b[7]);
+            return false;  // high-frequency, no state notify
+        case CMD_MOUSE_ABS:
+            if (len >= 6 && cmd_mouse_abs)
+                cmd_mouse_abs(b[1], rd_u16le(b + 2), rd_u16le(b + 4));
+            return false;  // high-frequency, no state notify
+        case CMD_KBD_REPORT_TO:
+            if (len >= 11 && cmd_kbd_report_to)
+                cmd_kbd_report_to(rd_u16le(b + 1), b + 3);
+            return false;  // addressed input doesn't touch the current central, no state notify
+        case CMD_MOUSE_TO:
+            if (len >= 7 && cmd_mouse_report_to)
+                cmd_mouse_report_to(rd_u16le(b + 1), b + 3);
+            return false;
+        case CMD_BT_ADV_TOGGLE:
+            if (cmd_bt_adv_toggle) cmd_bt_adv_toggle();
+            break;
+        case CMD_BT_CENTRAL_ACT:
+            if (len >= 3 && cmd_bt_central_activate)
+                cmd_bt_central_activate(rd_u16le(b + 1));
+            break;
+        case CMD_BT_CENTRAL_UNPAIR:
+            if (len >= 3 && cmd_bt_central_unpair)
+                cmd_bt_central_unpair(rd_u16le(b + 1));
+            break;
+        case CMD_TYPE: {
+            if (len >= 3) {
+                uint16_t tlen = rd_u16le(b + 1);
+                if (log_enabled()) log("CMD_TYPE: msg_len=%u text_len=%u", (unsigned)len, (unsigned)tlen);
+                if (len >= (size_t)(3 + tlen) && cmd_type) {
+                    string text((const char*)(b + 3), tlen);
+                    if (log_enabled()) log("Sending text: %s", text.c_str());
+                    cmd_type(text);
                 }
-                break;
             }
-            case CMD_REBOOT:
-                if (h.cmd_reboot) h.cmd_reboot();
-                return;  // no notify after reboot
-            default:
-                if (log_enabled()) log("WS rx unknown cmd 0x%02x", cmd);
-                return;
+            return false;  // typing engine reports its own progress
+        }
+        case CMD_TYPE_CANCEL:
+            if (cmd_type_cancel) cmd_type_cancel();
+            return false;  // typing engine reports its own progress
+        case CMD_SET_LAYOUT:
+            if (len >= 2 && cmd_set_layout)
+                cmd_set_layout(b[1]);
+            break;
+        case CMD_SET_TYPE_MODE:
+            if (len >= 2 && cmd_set_type_mode)
+                cmd_set_type_mode(b[1]);
+            break;
+        case CMD_BT_BROADCAST:
+            if (len >= 2 && cmd_bt_broadcast)
+                cmd_bt_broadcast(b[1] != 0);
+            break;
+        case CMD_GET_STATE:
+            notify();
+            return false;
+        case CMD_SET_STATUS_FORMAT:
+            if (len >= 2) {
+                ws.set_group(client, b[1] == STATUS_BINARY ? STATUS_BINARY : STATUS_JSON);
+                notify();
+            }
+            return false;
+        case CMD_REBOOT:
+            if (cmd_reboot) cmd_reboot();
+            return false;  // no notify after reboot
+        default:
+            if (log_enabled()) log("WS rx unknown cmd 0x%02x", cmd);
+            return false;
+    }
+    return true;
+}
+
+// Runs every command of a CMD_BATCH payload in order, notifies at most once for the whole batch.
+bool httpd::handle_batch(uint8_t client, const uint8_t *b, size_t len) {
+    stats.batches++;
+    bool changed = false;
+    size_t i = 0;
+    while (i < len) {
+        size_t clen = b[i++];
+        if (clen == 0 || i + clen > len) {
+            if (log_enabled()) log("WS batch: bad command length %u at %u", (unsigned)clen, (unsigned)i);
+            break;
         }
+        if (b[i] == CMD_BATCH) {
+            if (log_enabled()) log("WS batch: nested batch ignored");
+        } else {
+            changed |= handle_command(client, b + i, clen);
+        }
+        i += clen;
+    }
+    return changed;
+}
 
-        h.notify();
-    };
+// Status documents are written here and copied once into the outgoing frame.
+static char json_buf[HTTPD_JSON_BUF_SIZE];
+static_assert(HTTPD_JSON_BUF_SIZE <= WS_MAX_TX_PAYLOAD, "status JSON must fit a WebSocket frame buffer");
 
-    cyw43_arch_lwip_end();
+// Binary status frames are built here, header plus the largest central table.
+static uint8_t status_buf[HTTPD_STATUS_HDR_SIZE + HTTPD_STATUS_CENTRAL_SIZE * HTTPD_STATUS_MAX_CENTRALS];
+static_assert(sizeof(status_buf) <= WS_MAX_TX_PAYLOAD, "binary status must fit a WebSocket frame buffer");
+
+void httpd::send_json(const json_writer& w, uint8_t key, uint8_t group) {
+    if (!w.ok()) {
+        if (log_enabled()) log("WS: status JSON exceeds %u bytes, not sent", (unsigned)sizeof(json_buf));
+        return;
+    }
+    ws.send(w.data(), w.size(), key, group);
 }
 
 void httpd::notify() {
-    as.bt_centrals_json_array.clear();
-    update_as_cache();
-    uint64_t uptime_s = absolute_time_diff_us(start_time, get_absolute_time()) / 1000000ULL;
-    string state =
-        string("{\"uptime\":") + to_string(uptime_s) +
-        ",\"bt_adv\":"  + (as.is_advertising ? "true" : "false") +
-        ",\"ip\":\""    + ip4addr + "\"" +
-        ",\"bt_devices\":" + as.bt_centrals_json_array + "}";
-    ws.send(state);
-}
-
-void httpd::update_as_cache() {
-    if (as.bt_centrals_json_array.empty()) {
-        as.bt_centrals_json_array = "[";
-        for (size_t i = 0; i < as.bt_centrals.size(); i++) {
-            const app_bt_central& c = as.bt_centrals[i];
-            string elem = "{";
-            elem += "\"id\":"           + to_string(c.id);
-            elem += ",\"name\":\""      + c.name + "\"";
-            elem += ",\"is_active\":"   + string(c.is_active ? "true" : "false");
-            elem += ",\"addr\":\""      + c.addr + "\"";
-            elem += ",\"addr_type\":\"" + c.addr_type + "\"";
-            elem += "}";
-            as.bt_centrals_json_array += elem;
-            if (i < as.bt_centrals.size() - 1)
-                as.bt_centrals_json_array += ",";
+    if (ws.client_count(STATUS_JSON) > 0) send_full_json();
+    if (ws.client_count(STATUS_BINARY) > 0) send_status_frame();
+    as.dirty = 0;
+    notified_version = as.version;
+}
+
+void httpd::send_full_json() {
+    json_writer w(json_buf, sizeof(json_buf));
+    w.begin_object()
+        .field("v", as.version)
+        .field("full", true)
+        .field("uptime", uptime_s())
+        .field("ip", ip4addr)
+        .field("bt_adv", as.is_advertising)
+        .field("bt_adv_phase", adv_phase_str(as.bt_adv_phase))
+        .field("bt_broadcast", as.bt_broadcast)
+        .field("kbd_layout", as.kbd_layout)
+        .field("type_rollover", as.type_rollover);
+    write_centrals(w.key("bt_devices"));
+    write_hid_queue(w.key("hid_q"));
+    write_stats(w.key("ws"));
+    write_loop(w.key("loop"));
+    write_boot(w.key("boot"));
+    write_wifi(w.key("wifi"));
+    write_store(w.key("store"));
+    w.end_object();
+
+    send_json(w, WS_KEY_STATE, STATUS_JSON);  // only the latest full state is worth sending
+}
+
+void httpd::send_status_frame() {
+    size_t n = write_status_frame(status_buf, sizeof(status_buf));
+    ws.send_binary(status_buf, n, WS_KEY_STATE, STATUS_BINARY);
+}
+
+/**
+ * Writes the binary status frame, little endian, returns its size:
+ *   0  u8   BIN_STATUS
+ *   1  u8   number of central records that follow
+ *   2  u16  flags: 1 bt_adv, 2 bt_broadcast, 4 type_rollover, 8 Wi-Fi joined the cached access point
+ *   4  u32  v (app_state version)
+ *   8  u32  uptime (s)
+ *   12 u8x4 IPv4 address
+ *   16 char[4] kbd_layout, zero padded
+ *   20 u32  hid queue depth, high water, overflows
+ *   32 u32  cmds, frames, batches, rate, cmd_ns, tx_drop, tx_superseded
+ *   60 u8   clients
+ *   61 u8   advertising phase: 0 off, 1 directed, 2 fast, 3 slow, then 2 bytes padding
+ *   64 u32  loop lag, peak, average (us)
+ *   76 u16  core 0 load, core 1 load (per mille)
+ *   80 u32  boot milestones: Bluetooth up, Wi-Fi up, first HID report, WebSocket server up (ms since power-on, 0 not yet)
+ *   96 u32  Wi-Fi outages, join attempts, last / longest / total outage (ms)
+ *   116 u32 boot milestone: first central connected
+ *   120 u32 flash: page programs, sector erases, worst / last stall (us), since boot
+ *   136 u16 settings store: pending changes, bytes used in the active sector
+ *   140 u32 settings store: failed commits, since boot
+ * then per central (HTTPD_STATUS_CENTRAL_SIZE bytes):
+ *   0  u16  id
+ *   2  u8   flags: 1 is_active, 2 random address
+ *   3  u8   name length
+ *   4  u8x6 address, in display order
+ *   10 u16  latency
+ *   12 u32  interval_us, sent, dropped
+ *   24 char[24] name (UTF-8, cut at a character boundary), zero padded
+ * Always a full state, there are no binary deltas: one frame is smaller than most JSON deltas.
+ */
+size_t httpd::write_status_frame(uint8_t *buf, size_t cap) const {
+    size_t max_centrals = (cap - HTTPD_STATUS_HDR_SIZE) / HTTPD_STATUS_CENTRAL_SIZE;
+    size_t count = as.bt_centrals.size() < max_centrals ? as.bt_centrals.size() : max_centrals;
+    memset(buf, 0, HTTPD_STATUS_HDR_SIZE + count * HTTPD_STATUS_CENTRAL_SIZE);
+
+    buf[0] = BIN_STATUS;
+    buf[1] = (uint8_t)count;
+    wr_u16le(buf + 2, (as.is_advertising ? 1 : 0) | (as.bt_broadcast ? 2 : 0) | (as.type_rollover ? 4 : 0) | (as.boot_wifi_fast ? 8 : 0));
+    wr_u32le(buf + 4, as.version);
+    wr_u32le(buf + 8, (uint32_t)uptime_s());
+    memcpy(buf + 12, ip4, 4);
+    memcpy(buf + 16, as.kbd_layout.data(), as.kbd_layout.size() < 4 ? as.kbd_layout.size() : 4);
+    wr_u32le(buf + 20, as.hid_queue_depth);
+    wr_u32le(buf + 24, as.hid_queue_high_water);
+    wr_u32le(buf + 28, as.hid_queue_overflows);
+    wr_u32le(buf + 32, stats.cmds);
+    wr_u32le(buf + 36, stats.frames);
+    wr_u32le(buf + 40, stats.batches);
+    wr_u32le(buf + 44, stats.rate);
+    wr_u32le(buf + 48, stats.cmds > 0 ? (uint32_t)(stats.busy_us * 1000ULL / stats.cmds) : 0);
+    wr_u32le(buf + 52, ws.tx_dropped);
+    wr_u32le(buf + 56, ws.tx_superseded);
+    buf[60] = (uint8_t)ws.client_count();
+    buf[61] = (uint8_t)as.bt_adv_phase;
+    wr_u32le(buf + 64, as.loop_lag_us);
+    wr_u32le(buf + 68, as.loop_lag_peak_us);
+    wr_u32le(buf + 72, as.loop_lag_avg_us);
+    wr_u16le(buf + 76, as.core_load_pm[0]);
+    wr_u16le(buf + 78, as.core_load_pm[1]);
+    wr_u32le(buf + 80, as.boot_bt_ms);
+    wr_u32le(buf + 84, as.boot_wifi_ms);
+    wr_u32le(buf + 88, as.boot_first_report_ms);
+    wr_u32le(buf + 92, as.boot_ws_ms);
+    wr_u32le(buf + 96, link.outages);
+    wr_u32le(buf + 100, (uint32_t)connection_attempts);
+    wr_u32le(buf + 104, link.last_outage_ms);
+    wr_u32le(buf + 108, link.max_outage_ms);
+    wr_u32le(buf + 112, link.total_outage_ms);
+    wr_u32le(buf + 116, as.boot_central_ms);
+    wr_u32le(buf + 120, as.store_programs);
+    wr_u32le(buf + 124, as.store_erases);
+    wr_u32le(buf + 128, as.store_stall_max_us);
+    wr_u32le(buf + 132, as.store_stall_last_us);
+    wr_u16le(buf + 136, (uint16_t)as.store_pending);
+    wr_u16le(buf + 138, (uint16_t)as.store_used);
+    wr_u32le(buf + 140, as.store_failed);
+
+    uint8_t *r = buf + HTTPD_STATUS_HDR_SIZE;
+    for (size_t i = 0; i < count; i++, r += HTTPD_STATUS_CENTRAL_SIZE) {
+        const app_bt_central& c = as.bt_centrals[i];
+        wr_u16le(r, c.id);
+        r[2] = (c.is_active ? 1 : 0) | (c.addr_type == "random" ? 2 : 0);
+
+        // keep the name whole up to the last character that fits
+        size_t nlen = c.name.size();
+        if (nlen > HTTPD_STATUS_NAME_LEN) {
+            nlen = HTTPD_STATUS_NAME_LEN;
+            while (nlen > 0 && (static_cast<uint8_t>(c.name[nlen]) & 0xC0) == 0x80) nlen--;
         }
-        as.bt_centrals_json_array += "]";
+        r[3] = (uint8_t)nlen;
+
+        // "AA:BB:CC:DD:EE:FF"
+        for (size_t j = 0; j < 6 && j * 3 + 1 < c.addr.size(); j++)
+            r[4 + j] = (uint8_t)(hex_nibble(c.addr[j * 3]) << 4 | hex_nibble(c.addr[j * 3 + 1]));
+
+        wr_u16le(r + 10, c.conn_latency);
+        wr_u32le(r + 12, c.conn_interval_us);
+        wr_u32le(r + 16, c.reports_sent);
+        wr_u32le(r + 20, c.reports_dropped);
+        memcpy(r + 24, c.name.data(), nlen);
+    }
+    return HTTPD_STATUS_HDR_SIZE + count * HTTPD_STATUS_CENTRAL_SIZE;
+}
+
+void httpd::notify_changes() {
+    if (as.dirty == 0) return;
+    if (ws.client_count(STATUS_JSON) > 0) send_json_delta();
+    if (ws.client_count(STATUS_BINARY) > 0) send_status_frame();
+    as.dirty = 0;
+    notified_version = as.version;
+}
+
+void httpd::send_json_delta() {
+    // base lets clients spot a delta they missed and ask for the full state instead
+    json_writer w(json_buf, sizeof(json_buf));
+    w.begin_object()
+        .field("v", as.version)
+        .field("base", notified_version);
+    if (as.dirty & APP_DIRTY_BT_ADV)
+        w.field("bt_adv", as.is_advertising).field("bt_adv_phase", adv_phase_str(as.bt_adv_phase));
+    if (as.dirty & APP_DIRTY_BT_BROADCAST)
+        w.field("bt_broadcast", as.bt_broadcast);
+    if (as.dirty & APP_DIRTY_KBD)
+        w.field("kbd_layout", as.kbd_layout).field("type_rollover", as.type_rollover);
+    if (as.dirty & APP_DIRTY_CENTRALS)
+        write_centrals(w.key("bt_devices"));
+    if (as.dirty & APP_DIRTY_STATS) {
+        write_hid_queue(w.key("hid_q"));
+        write_stats(w.key("ws"));
+        write_loop(w.key("loop"));
+        write_boot(w.key("boot"));
+        write_wifi(w.key("wifi"));
+        write_store(w.key("store"));
+    }
+    w.end_object();
+
+    send_json(w, 0, STATUS_JSON);  // never superseded, every delta is needed
+}
+
+void httpd::heartbeat() {
+    json_writer w(json_buf, sizeof(json_buf));
+    w.begin_object().field("uptime", uptime_s()).end_object();
+    send_json(w, WS_KEY_UPTIME);
+}
+
+uint64_t httpd::uptime_s() const {
+    return absolute_time_diff_us(start_time, get_absolute_time()) / 1000000ULL;
+}
+
+void httpd::write_hid_queue(json_writer& w) const {
+    w.begin_object()
+        .field("depth", as.hid_queue_depth)
+        .field("hw", as.hid_queue_high_water)
+        .field("ovf", as.hid_queue_overflows)
+        .end_object();
+}
+
+void httpd::notify_typing(uint32_t done, uint32_t total, uint32_t reports, uint32_t cps, const char* state) {
+    json_writer w(json_buf, sizeof(json_buf));
+    w.begin_object().key("typing").begin_object()
+        .field("done", done)
+        .field("total", total)
+        .field("reports", reports)
+        .field("cps", cps)
+        .field("state", state)
+        .end_object().end_object();
+    send_json(w);
+}
+
+// Takes a command rate sample, marks the stats dirty if anything moved since the previous one.
+void httpd::sample_stats() {
+    uint32_t now = time_us_32();
+    uint32_t dt_us = now - stats.last_sample_us;
+    uint32_t cmds = stats.cmds - stats.last_cmds;
+    uint32_t rate = dt_us > 0 ? (uint32_t)((uint64_t)cmds * 1000000ULL / dt_us) : 0;
+    uint32_t clients = ws.client_count();
+    stats.last_sample_us = now;
+    stats.last_cmds = stats.cmds;
+
+    if (rate != stats.rate || clients != stats.clients || ws.tx_dropped != stats.tx_dropped) {
+        stats.rate = rate;
+        stats.clients = clients;
+        stats.tx_dropped = ws.tx_dropped;
+        as.mark(APP_DIRTY_STATS);
+    }
+}
+
+// Command counters, command rate at the last sample and average handling time.
+void httpd::write_stats(json_writer& w) const {
+    uint32_t cmd_ns = stats.cmds > 0 ? (uint32_t)(stats.busy_us * 1000ULL / stats.cmds) : 0;
+    w.begin_object()
+        .field("cmds", stats.cmds)
+        .field("frames", stats.frames)
+        .field("batches", stats.batches)
+        .field("rate", stats.rate)
+        .field("cmd_ns", cmd_ns)
+        .field("clients", ws.client_count())
+        .field("tx_drop", ws.tx_dropped)
+        .field("tx_superseded", ws.tx_superseded)
+        .end_object();
+}
+
+// Main loop scheduler lag, how late periodic work started, and how busy each core was.
+void httpd::write_loop(json_writer& w) const {
+    w.begin_object()
+        .field("lag_us", as.loop_lag_us)
+        .field("peak_us", as.loop_lag_peak_us)
+        .field("avg_us", as.loop_lag_avg_us)
+        .key("load_pm").begin_array().value(as.core_load_pm[0]).value(as.core_load_pm[1]).end_array()
+        .end_object();
+}
+
+// Wi-Fi link supervision: outages (link lost after being up), join attempts and how long the outages lasted.
+void httpd::write_wifi(json_writer& w) const {
+    w.begin_object()
+        .field("outages", link.outages)
+        .field("attempts", connection_attempts)
+        .field("last_outage_ms", link.last_outage_ms)
+        .field("max_outage_ms", link.max_outage_ms)
+        .field("down_ms", link.total_outage_ms)
+        .end_object();
+}
+
+// Settings store: changes waiting for an idle window, flash programs and erases, and the worst time both cores were held for one.
+void httpd::write_store(json_writer& w) const {
+    w.begin_object()
+        .field("pending", as.store_pending)
+        .field("programs", as.store_programs)
+        .field("erases", as.store_erases)
+        .field("failed", as.store_failed)
+        .field("used", as.store_used)
+        .field("stall_us", as.store_stall_last_us)
+        .field("max_stall_us", as.store_stall_max_us)
+        .end_object();
+}
+
+// When Bluetooth, Wi-Fi, the first central, the first HID report and the WebSocket server came up, ms since power-on (0: not yet),
+// and whether Wi-Fi took the fast path to the cached access point.
+void httpd::write_boot(json_writer& w) const {
+    w.begin_object()
+        .field("bt_ms", as.boot_bt_ms)
+        .field("wifi_ms", as.boot_wifi_ms)
+        .field("first_report_ms", as.boot_first_report_ms)
+        .field("ws_ms", as.boot_ws_ms)
+        .field("central_ms", as.boot_central_ms)
+        .field("wifi_fast", as.boot_wifi_fast)
+        .end_object();
+}
+
+void httpd::write_centrals(json_writer& w) const {
+    w.begin_array();
+    for (const app_bt_central& c : as.bt_centrals) {
+        w.begin_object()
+            .field("id", c.id)
+            .field("name", c.name)
+            .field("is_active", c.is_active)
+            .field("addr", c.addr)
+            .field("addr_type", c.addr_type)
+            .field("interval_us", c.conn_interval_us)
+            .field("latency", c.conn_latency)
+            .field("sent", c.reports_sent)
+            .field("dropped", c.reports_dropped)
+            .end_object();
     }
+    w.end_array();
 }
@@ -4,37 +4,142 @@
 #include <functional>
 #include "model.h"
 #include "websocket.h"
+#include "json_writer.h"
+
+// largest status document (full state with every central connected)
+constexpr size_t HTTPD_JSON_BUF_SIZE = 2048;
+
+// give up on a Wi-Fi join attempt and start over after this long
+constexpr uint32_t HTTPD_CONNECT_TIMEOUT_MS = 30000;
+
+// wait between failed joins, doubled after each one up to the max
+constexpr uint32_t HTTPD_RETRY_MIN_MS = 1000;
+constexpr uint32_t HTTPD_RETRY_MAX_MS = 16000;
+
+// a join straight to the cached access point normally takes well under a second, fall back to a full scan after this
+constexpr uint32_t HTTPD_FAST_JOIN_TIMEOUT_MS = 5000;
+
+// Binary status frame (see write_status_frame): fixed header, then one fixed size record per central.
+constexpr size_t HTTPD_STATUS_HDR_SIZE = 144;
+constexpr size_t HTTPD_STATUS_CENTRAL_SIZE = 48;
+constexpr size_t HTTPD_STATUS_NAME_LEN = 24;     // central name bytes kept, longer names are cut
+constexpr size_t HTTPD_STATUS_MAX_CENTRALS = 16;
 
 class httpd {
 public:
     static httpd* g_httpd;
     bool is_connected{false};
     int connection_attempts{0};
+    absolute_time_t connect_started;
+    bool fast_join{false};   // the current attempt goes straight to the cached access point
     std::string ip4addr;
+    uint8_t ip4[4]{};  // ip4addr as bytes, for the binary status frame
     absolute_time_t start_time;
     app_state& as;
     ws_server ws;
 
+    // WebSocket command throughput
+    struct cmd_stats {
+        uint32_t cmds{0};            // commands run, batched or not
+        uint32_t frames{0};          // WebSocket messages carrying commands
+        uint32_t batches{0};         // of which CMD_BATCH
+        uint64_t busy_us{0};         // time spent handling them
+        uint32_t last_cmds{0};       // cmds at the previous rate sample
+        uint32_t last_sample_us{0};
+        uint32_t rate{0};            // commands per second at the last sample
+        uint32_t clients{0};         // client count at the last sample
+        uint32_t tx_dropped{0};      // ws.tx_dropped at the last sample
+    } stats;
+
     httpd(app_state& as) : as(as) {}
 
     void init();
+    // Wi-Fi link supervision
+    struct link_stats {
+        uint32_t outages{0};          // times the link was lost after being up
+        uint32_t last_outage_ms{0};   // how long the latest outage lasted until the link was back
+        uint32_t max_outage_ms{0};
+        uint32_t total_outage_ms{0};
+        absolute_time_t down_since{};
+    } link;
+
+    // Starts joining the Wi-Fi network, doesn't block. supervise() follows it up.
+    // Goes straight to the access point (BSSID and channel) of the last good join if that is cached in flash,
+    // a full scan otherwise or once that failed.
     void connect();
+
+    // Keeps the Wi-Fi link up without ever blocking: follows the join, starts the servers once it went
+    // through, retries failed or timed out attempts with backoff, and rejoins when the link is lost.
+    // Right after a fast join the cached lease (or WIFI_STATIC_IP) is used as the address, so the servers
+    // don't wait for DHCP. Call periodically from the async context.
+    void supervise();
     void start();
 
-    // Push current state to the connected WebSocket client.
+    // Push the full state to all connected WebSocket clients, serialized once per status format.
     // Must be called from within the lwIP context (TCP callback or
-    // between cyw43_arch_lwip_begin() / cyw43_arch_lwip_end()).
+    // between cyw43_arch_lwip_begin() / cyw43_arch_lwip_end()), same for the other notify_* calls.
     void notify();
 
+    // Push only the parts of app_state marked dirty since the last notification, if any.
+    void notify_changes();
+
+    // Push uptime only, keeps idle clients alive.
+    void heartbeat();
+
+    // Samples the command rate, marks stats dirty when they moved.
+    void sample_stats();
+
+    // Push typing engine progress (characters typed / total, reports used, chars/sec, state) to the WebSocket clients.
+    void notify_typing(uint32_t done, uint32_t total, uint32_t reports, uint32_t cps, const char* state);
+
     // commands
     std::function<void(const uint8_t report[8])> cmd_kbd_report;  // 8-byte HID keyboard report
     std::function<void(const uint8_t report[4])> cmd_mouse_report;  // 4-byte HID mouse report
+    std::function<void(uint8_t buttons, int16_t dx, int16_t dy, int8_t wheel, int8_t pan)> cmd_mouse_wide;
+    std::function<void(uint8_t buttons, uint16_t x, uint16_t y)> cmd_mouse_abs;  // absolute pointer, 0..HID_MOUSE_ABS_MAX
+    std::function<void(uint16_t central_id, const uint8_t report[8])> cmd_kbd_report_to;
+    std::function<void(uint16_t central_id, const uint8_t report[4])> cmd_mouse_report_to;
     std::function<void()> cmd_reboot;
     std::function<void()> cmd_bt_adv_toggle;
+    std::function<void(bool on)> cmd_bt_broadcast;
     std::function<void(uint16_t central_id)> cmd_bt_central_activate;
     std::function<void(uint16_t central_id)> cmd_bt_central_unpair;
     std::function<void(const std::string& text)> cmd_type;
+    std::function<void()> cmd_type_cancel;
+    std::function<void(uint8_t layout)> cmd_set_layout;
+    std::function<void(uint8_t mode)> cmd_set_type_mode;
 
 private:
-    void update_as_cache();
+    uint32_t notified_version{0};  // app_state version clients were last brought to
+    bool try_cache{true};          // use the cached access point on the next attempt
+    bool address_set{false};       // cached lease or static address applied for this join
+    bool cache_checked{false};     // cache updated for this join (needs the final address)
+    bool servers_started{false};
+    bool retry_pending{false};     // waiting for retry_at to join again
+    absolute_time_t retry_at{};
+    uint32_t backoff_ms{HTTPD_RETRY_MIN_MS};
+    absolute_time_t listen_retry_at{};
+
+    void joined();
+    void watch_link();
+    void retry_later();
+    void set_address();
+    void update_ip();
+    void update_wifi_cache();
+
+    uint64_t uptime_s() const;
+    void send_json(const json_writer& w, uint8_t key = 0, uint8_t group = WS_GROUP_ALL);
+    void send_full_json();
+    void send_json_delta();
+    void send_status_frame();
+    size_t write_status_frame(uint8_t *buf, size_t cap) const;
+    void write_centrals(json_writer& w) const;
+    void write_hid_queue(json_writer& w) const;
+    void write_stats(json_writer& w) const;
+    void write_loop(json_writer& w) const;
+    void write_boot(json_writer& w) const;
+    void write_wifi(json_writer& w) const;
+    void write_store(json_writer& w) const;
+    bool handle_command(uint8_t client, const uint8_t *b, size_t len);
+    bool handle_batch(uint8_t client, const uint8_t *b, size_t len);
 };
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include "json_writer.h"
+#include <cstring>
+
+void json_writer::reset() {
+    len_ = 0;
+    overflow_ = false;
+    depth_ = 0;
+    after_key_ = false;
+}
+
+void json_writer::put(char c) {
+    if (len_ < cap_) {
+        buf_[len_++] = c;
+    } else {
+        overflow_ = true;
+    }
+}
+
+void json_writer::put(const char* s, size_t n) {
+    size_t room = cap_ - len_;
+    if (n > room) {
+        n = room;
+        overflow_ = true;
+    }
+    memcpy(buf_ + len_, s, n);
+    len_ += n;
+}
+
+// comma before every member/element but the first of its object/array
+void json_writer::separate() {
+    if (after_key_) {
+        after_key_ = false;
+        return;
+    }
+    if (depth_ == 0) return;
+    if (!first_[depth_ - 1]) put(',');
+    first_[depth_ - 1] = false;
+}
+
+json_writer& json_writer::open(char c) {
+    separate();
+    put(c);
+    if (depth_ < JSON_WRITER_MAX_DEPTH) {
+        first_[depth_++] = true;
+    } else {
+        overflow_ = true;
+    }
+    return *this;
+}
+
+json_writer& json_writer::close(char c) {
+    if (depth_ > 0) depth_--;
+    put(c);
+    return *this;
+}
+
+json_writer& json_writer::begin_object() { return open('{'); }
+json_writer& json_writer::end_object() { return close('}'); }
+json_writer& json_writer::begin_array() { return open('['); }
+json_writer& json_writer::end_array() { return close(']'); }
+
+json_writer& json_writer::key(const char* k) {
+    separate();
+    put('"');
+    escaped(k, strlen(k));
+    put('"');
+    put(':');
+    after_key_ = true;
+    return *this;
+}
+
+json_writer& json_writer::value(const char* s) {
+    return string_value(s, strlen(s));
+}
+
+json_writer& json_writer::value(bool b) {
+    separate();
+    if (b) put("true", 4);
+    else put("false", 5);
+    return *this;
+}
+
+json_writer& json_writer::string_value(const char* s, size_t n) {
+    separate();
+    put('"');
+    escaped(s, n);
+    put('"');
+    return *this;
+}
+
+json_writer& json_writer::number(uint64_t v, bool negative) {
+    separate();
+    char tmp[21];
+    size_t i = sizeof(tmp);
+    do {
+        tmp[--i] = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    if (negative) tmp[--i] = '-';
+    put(tmp + i, sizeof(tmp) - i);
+    return *this;
+}
+
+// RFC 8259: quote, backslash and control characters are escaped, UTF-8 passes through
+void json_writer::escaped(const char* s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        switch (c) {
+            case '"':  put("\\\"", 2); break;
+            case '\\': put("\\\\", 2); break;
+            case '\n': put("\\n", 2); break;
+            case '\r': put("\\r", 2); break;
+            case '\t': put("\\t", 2); break;
+            case '\b': put("\\b", 2); break;
+            case '\f': put("\\f", 2); break;
+            default:
+                if (c < 0x20) {
+                    char u[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                    put(u, sizeof(u));
+                } else {
+                    put(static_cast<char>(c));
+                }
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+// deepest object/array nesting the writer tracks
+constexpr size_t JSON_WRITER_MAX_DEPTH = 8;
+
+/**
+ * Streaming JSON writer over a caller-owned, fixed size buffer. Never allocates.
+ * Commas between members/elements are inserted automatically, strings are escaped.
+ * Output that doesn't fit sets the overflow flag and is cut off, so check ok() before using data().
+ *
+ *   json_writer w(buf, sizeof(buf));
+ *   w.begin_object().field("uptime", 42u).key("list").begin_array().value("a").end_array().end_object();
+ */
+class json_writer {
+public:
+    json_writer(char* buf, size_t cap) : buf_(buf), cap_(cap) {}
+
+    json_writer& begin_object();
+    json_writer& end_object();
+    json_writer& begin_array();
+    json_writer& end_array();
+
+    json_writer& key(const char* k);
+
+    json_writer& value(const char* s);
+    json_writer& value(const std::string& s) { return string_value(s.data(), s.size()); }
+    json_writer& value(bool b);
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, json_writer&>::type
+    value(T v) {
+        if (std::is_signed<T>::value && v < 0) return number(0 - static_cast<uint64_t>(static_cast<int64_t>(v)), true);
+        return number(static_cast<uint64_t>(v), false);
+    }
+
+    template <typename T>
+    json_writer& field(const char* k, const T& v) { return key(k).value(v); }
+
+    // Clears the output, the buffer can be reused for the next document.
+    void reset();
+
+    bool ok() const { return !overflow_; }
+    const char* data() const { return buf_; }
+    size_t size() const { return len_; }
+
+private:
+    char* buf_;
+    size_t cap_;
+    size_t len_{0};
+    bool overflow_{false};
+    uint8_t depth_{0};
+    bool first_[JSON_WRITER_MAX_DEPTH]{};  // nothing written at this level yet
+    bool after_key_{false};
+
+    void separate();
+    void put(char c);
+    void put(const char* s, size_t n);
+    json_writer& open(char c);
+    json_writer& close(char c);
+    json_writer& string_value(const char* s, size_t n);
+    json_writer& number(uint64_t v, bool negative);
+    void escaped(const char* s, size_t n);
+};
@@ -0,0 +1,270 @@
+#include "kv_store.h"
+#include "log.h"
+#include <string.h>
+
+using namespace std;
+
+namespace {
+
+constexpr uint32_t kMagic = 0x3156484B; // "KHV1"
+constexpr uint32_t kHeaderSize = 8;
+constexpr uint8_t kDeleted = 0xff;
+
+uint32_t sector_offset(uint32_t sector) {
+    return FLASH_KV_OFFSET + sector * FLASH_SECTOR_SIZE;
+}
+
+// first byte past the page pos is in
+uint32_t page_end(uint32_t pos) {
+    return (pos / FLASH_PAGE_SIZE + 1) * FLASH_PAGE_SIZE;
+}
+
+uint32_t record_size(size_t key_len, size_t value_len) {
+    return (uint32_t)((4 + key_len + value_len + 3) & ~size_t(3));
+}
+
+// CRC-16/CCITT-FALSE
+uint16_t crc16(uint16_t crc, const uint8_t *d, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        crc ^= (uint16_t)(d[i] << 8);
+        for (int b = 0; b < 8; b++) crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+uint16_t record_crc(const uint8_t *r, size_t key_len, size_t value_len) {
+    uint16_t crc = crc16(0xffff, r, 2);
+    return crc16(crc, r + 4, key_len + value_len);
+}
+
+// Writes a record to r, value nullptr for a deletion. The padding keeps whatever r holds (0xff in an empty page).
+void encode(uint8_t *r, const string& key, const string *value) {
+    size_t vlen = value ? value->size() : 0;
+    r[0] = (uint8_t)key.size();
+    r[1] = value ? (uint8_t)vlen : kDeleted;
+    memcpy(r + 4, key.data(), key.size());
+    if (value) memcpy(r + 4 + key.size(), value->data(), vlen);
+    uint16_t crc = record_crc(r, key.size(), vlen);
+    r[2] = (uint8_t)crc;
+    r[3] = (uint8_t)(crc >> 8);
+}
+
+} // namespace
+
+void kv_store::init() {
+    bool found = false;
+    for (uint32_t s = 0; s < FLASH_KV_SECTORS; s++) {
+        const uint32_t *h = flash_page_read<uint32_t>(sector_offset(s));
+        if (h[0] != kMagic || h[1] == 0 || h[1] == 0xffffffff) continue;
+        if (!found || (int32_t)(h[1] - stats_.generation) > 0) {
+            found = true;
+            sector_ = s;
+            stats_.generation = h[1];
+        }
+    }
+    if (!found) {
+        if (log_enabled()) log("kv: empty");
+        return;
+    }
+
+    replay(sector_);
+    if (log_enabled()) log("kv: %u entries, %u of %u bytes used in sector %u, generation %u", (unsigned)entries_.size(),
+                           (unsigned)pos_, (unsigned)FLASH_SECTOR_SIZE, (unsigned)sector_, (unsigned)stats_.generation);
+}
+
+void kv_store::replay(uint32_t sector) {
+    const uint8_t *f = flash_page_read<uint8_t>(sector_offset(sector));
+    uint32_t pos = kHeaderSize;
+    uint32_t tail = 0;  // erased rest of the previous page, the log may end there
+    while (pos < FLASH_SECTOR_SIZE) {
+        uint32_t end = page_end(pos);
+        const uint8_t *r = f + pos;
+        if (r[0] == 0xff) {
+            bool page_start = pos == kHeaderSize || pos % FLASH_PAGE_SIZE == 0;
+            if (page_start) break;  // nothing was ever written from here on
+            tail = pos;
+            pos = end;
+            continue;
+        }
+        tail = 0;
+
+        size_t klen = r[0];
+        size_t vlen = r[1] == kDeleted ? 0 : r[1];
+        uint32_t size = record_size(klen, vlen);
+        bool ok = klen > 0 && klen <= KV_MAX_KEY && vlen <= KV_MAX_VALUE && pos + size <= end &&
+                  record_crc(r, klen, vlen) == (uint16_t)(r[2] | r[3] << 8);
+        if (!ok) {
+            if (log_enabled()) log("kv: bad record at %u in sector %u, skipping the page", (unsigned)pos, (unsigned)sector);
+            pos = end;
+            continue;
+        }
+
+        string key(reinterpret_cast<const char*>(r + 4), klen);
+        if (r[1] == kDeleted) {
+            entries_.erase(key);
+        } else {
+            entries_[key] = string(reinterpret_cast<const char*>(r + 4 + klen), vlen);
+        }
+        pos += size;
+    }
+    pos_ = tail ? tail : pos;
+    stats_.used = pos_;
+}
+
+const string* kv_store::get(const string& key) const {
+    auto it = entries_.find(key);
+    return it != entries_.end() ? &it->second : nullptr;
+}
+
+bool kv_store::put(const string& key, const string& value) {
+    if (key.empty() || key.size() > KV_MAX_KEY || value.size() > KV_MAX_VALUE) return false;
+    auto it = entries_.find(key);
+    if (it != entries_.end() && it->second == value) return true;
+    if (it != entries_.end() && value.size() < it->second.size()) full_ = false;
+    entries_[key] = value;
+    queue(key);
+    return true;
+}
+
+void kv_store::erase(const string& key) {
+    auto it = entries_.find(key);
+    if (it == entries_.end()) return;
+    entries_.erase(it);
+    full_ = false;
+    queue(key);
+}
+
+void kv_store::queue(const string& key) {
+    if (pending_.empty()) pending_since_ = get_absolute_time();
+    pending_.insert(key);
+}
+
+uint32_t kv_store::pending_ms() const {
+    if (pending_.empty()) return 0;
+    return (uint32_t)(absolute_time_diff_us(pending_since_, get_absolute_time()) / 1000);
+}
+
+void kv_store::for_each(const string& prefix, const function<void(const string& rest, const string& value)>& fn) const {
+    for (auto it = entries_.lower_bound(prefix); it != entries_.end(); ++it) {
+        if (it->first.compare(0, prefix.size(), prefix) != 0) break;
+        fn(it->first.substr(prefix.size()), it->second);
+    }
+}
+
+bool kv_store::commit() {
+    if (pending_.empty()) return true;
+
+    // the latest state of each queued key, however often it changed
+    vector<record> records;
+    records.reserve(pending_.size());
+    for (const string& key : pending_) {
+        auto it = entries_.find(key);
+        records.push_back(record{&key, it != entries_.end() ? &it->second : nullptr});
+    }
+
+    uint32_t pos = pos_;
+    bool ok;
+    if (stats_.generation != 0 && write_records(sector_, pos, records)) {
+        pos_ = pos;
+        stats_.used = pos;
+        ok = true;
+    } else {
+        // full (or no sector yet, or a failed program left the page in doubt): start over in the next one
+        ok = compact();
+    }
+    if (!ok) {
+        stats_.failed++;
+        return false;
+    }
+
+    stats_.commits++;
+    pending_.clear();
+    return true;
+}
+
+/**
+ * Packs records into sector from pos on, each page is programmed once with all the records going into it.
+ * Returns false if they don't fit (nothing was written then) or if flash failed.
+ */
+bool kv_store::write_records(uint32_t sector, uint32_t& pos, const vector<record>& records) {
+    if (records_end(pos, records) > FLASH_SECTOR_SIZE) return false;
+
+    uint32_t base = sector_offset(sector);
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xff, sizeof(page));
+    bool pending = false;  // page holds records not programmed yet
+    // programs the page the records before pos are in
+    auto flush = [&]() {
+        bool ok = program(base + (pos - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE, page);
+        memset(page, 0xff, sizeof(page));
+        pending = false;
+        return ok;
+    };
+    for (const record& r : records) {
+        uint32_t size = record_size(r.key->size(), r.value ? r.value->size() : 0);
+        if (pos + size > page_end(pos)) {
+            if (pending && !flush()) return false;
+            pos = page_end(pos);
+        }
+        encode(page + pos % FLASH_PAGE_SIZE, *r.key, r.value);
+        pos += size;
+        pending = true;
+        if (pos % FLASH_PAGE_SIZE == 0 && !flush()) return false;
+    }
+    return !pending || flush();
+}
+
+// Where the records would end if they were packed from pos on, without writing anything.
+uint32_t kv_store::records_end(uint32_t pos, const vector<record>& records) {
+    for (const record& r : records) {
+        uint32_t size = record_size(r.key->size(), r.value ? r.value->size() : 0);
+        if (pos + size > page_end(pos)) pos = page_end(pos);
+        pos += size;
+    }
+    return pos;
+}
+
+// Writes the live entries to the next sector and makes it the active one.
+bool kv_store::compact() {
+    vector<record> records;
+    records.reserve(entries_.size());
+    for (const auto& e : entries_) records.push_back(record{&e.first, &e.second});
+    // checked before the erase: trying again won't make them fit, and each try would cost an erase
+    full_ = records_end(kHeaderSize, records) > FLASH_SECTOR_SIZE;
+    if (full_) {
+        if (log_enabled()) log("kv: %u entries don't fit one sector", (unsigned)entries_.size());
+        return false;
+    }
+
+    uint32_t next = stats_.generation == 0 ? sector_ : (sector_ + 1) % FLASH_KV_SECTORS;
+    uint32_t base = sector_offset(next);
+    if (!flash_sector_erase(base)) return false;
+
+    uint32_t pos = kHeaderSize;
+    if (!write_records(next, pos, records)) {
+        if (log_enabled()) log("kv: writing %u entries to sector %u failed", (unsigned)entries_.size(), (unsigned)next);
+        return false;
+    }
+
+    // the header goes in last, the sector doesn't count before
+    uint32_t generation = stats_.generation + 1;
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xff, sizeof(page));
+    memcpy(page, &kMagic, 4);
+    memcpy(page + 4, &generation, 4);
+    if (!program(base, page)) return false;
+
+    sector_ = next;
+    pos_ = pos;
+    stats_.generation = generation;
+    stats_.used = pos;
+    stats_.compactions++;
+    if (log_enabled()) log("kv: %u entries moved to sector %u, %u bytes, generation %u", (unsigned)entries_.size(),
+                           (unsigned)next, (unsigned)pos, (unsigned)generation);
+    return true;
+}
+
+bool kv_store::program(uint32_t offset, const uint8_t *page) {
+    stats_.programs++;
+    return flash_page_program(offset, page);
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include "flash_page.h"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// longest key and value accepted by kv_store::put
+constexpr size_t KV_MAX_KEY = 48;
+constexpr size_t KV_MAX_VALUE = 64;
+
+// pending changes are committed once HID input has been quiet this long
+constexpr uint32_t KV_COMMIT_IDLE_MS = 2000;
+// or after this long regardless, so a long busy session can't hold them back for good
+constexpr uint32_t KV_COMMIT_MAX_DELAY_MS = 60000;
+
+// wait after a failed commit, doubled after each one in a row up to the max
+constexpr uint32_t KV_RETRY_MIN_MS = 1000;
+constexpr uint32_t KV_RETRY_MAX_MS = 300000;
+
+/**
+ * Small persistent key/value store, log-structured over the FLASH_KV_SECTORS sectors at FLASH_KV_OFFSET.
+ * put() and erase() only change the RAM copy and queue the key, commit() writes what's queued later
+ * on, when flash stalls hurt less (see KV_COMMIT_IDLE_MS). Repeated changes to a key before a commit
+ * cost one record. A commit appends its records to the active sector, one page program per page touched
+ * and no erase: the rest of a page stays erased for the records after it. Once the active sector is full,
+ * the live entries move to the next sector in turn (so erases are spread over all of them) and that one
+ * takes over. Reads never touch flash.
+ *
+ * Sector: u32 magic, u32 generation (the highest valid one is active), then records.
+ * Record: u8 key length, u8 value length (0xff: key deleted), u16 crc16 (of both lengths, key and value),
+ * then key, value, padded to 4 bytes. Records don't cross page boundaries, the rest of a page that
+ * can't take the next record is left erased. A record with a bad crc (cut by a reset while it was
+ * programmed) ends its page, appending goes on in the next one.
+ * The header is programmed last when compacting, so a sector only counts once all its records are in.
+ *
+ * Runs from the async context, like the rest of the Bluetooth and Wi-Fi state.
+ */
+class kv_store {
+public:
+    struct stats_t {
+        uint32_t commits{0};      // commits that wrote something, since boot
+        uint32_t programs{0};     // page programs since boot
+        uint32_t compactions{0};  // sector changes since boot
+        uint32_t failed{0};       // commits that failed since boot, the changes stayed queued
+        uint32_t generation{0};   // of the active sector, 0 if there is none yet
+        uint32_t used{0};         // bytes of the active sector in use
+    };
+
+    // Finds the active sector and replays its records. Call once at startup, before the first get() or put().
+    void init();
+
+    const std::string* get(const std::string& key) const;
+
+    // Stores value under key and queues it for the next commit, unless it's stored already.
+    // False if the key or value is too long.
+    bool put(const std::string& key, const std::string& value);
+
+    void erase(const std::string& key);
+
+    // Calls fn for each entry whose key starts with prefix, with the rest of the key.
+    void for_each(const std::string& prefix, const std::function<void(const std::string& rest, const std::string& value)>& fn) const;
+
+    // Writes the queued changes to flash. Stalls both cores for each page program (and a sector erase when
+    // compacting), so call it when that's least in the way. False if flash failed or the entries don't fit a
+    // sector (see full()), the changes stay queued then.
+    bool commit();
+
+    // The live entries didn't fit one sector at the last commit, nothing was erased for it. Commits can't
+    // succeed before an erase() or a shorter value makes room.
+    bool full() const { return full_; }
+
+    // keys changed since the last commit
+    size_t pending() const { return pending_.size(); }
+
+    // how long the oldest queued change has been waiting, 0 if nothing is queued
+    uint32_t pending_ms() const;
+
+    const stats_t& stats() const { return stats_; }
+
+private:
+    // a record to write, value nullptr for a deletion
+    struct record {
+        const std::string *key;
+        const std::string *value;
+    };
+
+    std::map<std::string, std::string> entries_;
+    std::set<std::string> pending_;
+    absolute_time_t pending_since_{};
+    uint32_t sector_{0};      // active sector, 0 .. FLASH_KV_SECTORS - 1
+    uint32_t pos_{0};         // where the next record goes in it
+    bool full_{false};
+    stats_t stats_;
+
+    void replay(uint32_t sector);
+    void queue(const std::string& key);
+    bool compact();
+    static uint32_t records_end(uint32_t pos, const std::vector<record>& records);
+    bool write_records(uint32_t sector, uint32_t& pos, const std::vector<record>& records);
+    bool program(uint32_t offset, const uint8_t *page);
+};
+
+inline kv_store g_kv_store;
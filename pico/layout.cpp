@@ -0,0 +1,205 @@
+#include "layout.h"
+#include <initializer_list>
+
+namespace {
+
+constexpr uint8_t S = HID_MOD_LSHIFT;
+constexpr uint8_t G = HID_MOD_RALT;
+
+struct mapping {
+    uint16_t ch;       // Latin-1 code point
+    uint8_t keycode;
+    uint8_t modifier;
+};
+
+constexpr void put(layout_table& t, std::initializer_list<mapping> ms) {
+    for (const mapping& m : ms) {
+        t[m.ch] = key_stroke{m.keycode, m.modifier};
+    }
+}
+
+// keys that are the same on every layout we support
+constexpr void put_common(layout_table& t) {
+    for (uint8_t i = 0; i < 26; i++) {
+        t['a' + i] = key_stroke{static_cast<uint8_t>(0x04 + i), 0};
+        t['A' + i] = key_stroke{static_cast<uint8_t>(0x04 + i), S};
+    }
+    put(t, {
+        {'\n', 0x28, 0},  // Enter ('\r' is skipped so CRLF text doesn't press Enter twice)
+        {'\t', 0x2B, 0},  // Tab
+        {'\b', 0x2A, 0},  // Backspace
+        {' ',  0x2C, 0},  // Space
+    });
+}
+
+// digit row: 1-9 are 0x1E-0x26, 0 is 0x27. AZERTY needs shift for digits.
+constexpr void put_digits(layout_table& t, uint8_t modifier) {
+    for (uint8_t i = 0; i < 9; i++) {
+        t['1' + i] = key_stroke{static_cast<uint8_t>(0x1E + i), modifier};
+    }
+    t['0'] = key_stroke{0x27, modifier};
+}
+
+constexpr layout_table make_us() {
+    layout_table t{};
+    put_common(t);
+    put_digits(t, 0);
+    put(t, {
+        {'!', 0x1E, S}, {'@', 0x1F, S}, {'#', 0x20, S}, {'$', 0x21, S}, {'%', 0x22, S},
+        {'^', 0x23, S}, {'&', 0x24, S}, {'*', 0x25, S}, {'(', 0x26, S}, {')', 0x27, S},
+        {'-', 0x2D, 0}, {'_', 0x2D, S}, {'=', 0x2E, 0}, {'+', 0x2E, S},
+        {'[', 0x2F, 0}, {'{', 0x2F, S}, {']', 0x30, 0}, {'}', 0x30, S},
+        {'\\', 0x31, 0}, {'|', 0x31, S}, {';', 0x33, 0}, {':', 0x33, S},
+        {'\'', 0x34, 0}, {'"', 0x34, S}, {'`', 0x35, 0}, {'~', 0x35, S},
+        {',', 0x36, 0}, {'<', 0x36, S}, {'.', 0x37, 0}, {'>', 0x37, S},
+        {'/', 0x38, 0}, {'?', 0x38, S},
+    });
+    return t;
+}
+
+constexpr layout_table make_uk() {
+    layout_table t = make_us();
+    put(t, {
+        {'"', 0x1F, S}, {0xA3, 0x20, S},                    // " £
+        {'@', 0x34, S},
+        {'#', 0x32, 0}, {'~', 0x32, S},                     // non-US # key
+        {'\\', 0x64, 0}, {'|', 0x64, S},                    // non-US \ key
+        {0xAC, 0x35, S}, {0xA6, 0x35, G},                   // ¬ ¦
+    });
+    return t;
+}
+
+constexpr layout_table make_de() {
+    layout_table t{};
+    put_common(t);
+    put_digits(t, 0);
+    put(t, {
+        {'z', 0x1C, 0}, {'Z', 0x1C, S}, {'y', 0x1D, 0}, {'Y', 0x1D, S},   // QWERTZ
+        {'!', 0x1E, S}, {'"', 0x1F, S}, {0xA7, 0x20, S}, {'$', 0x21, S}, {'%', 0x22, S},  // §
+        {'&', 0x23, S}, {'/', 0x24, S}, {'(', 0x25, S}, {')', 0x26, S}, {'=', 0x27, S},
+        {0xB2, 0x1F, G}, {0xB3, 0x20, G},                                 // ² ³
+        {'{', 0x24, G}, {'[', 0x25, G}, {']', 0x26, G}, {'}', 0x27, G},
+        {0xDF, 0x2D, 0}, {'?', 0x2D, S}, {'\\', 0x2D, G},                 // ß
+        {0xFC, 0x2F, 0}, {0xDC, 0x2F, S},                                 // ü Ü
+        {'+', 0x30, 0}, {'*', 0x30, S}, {'~', 0x30, G},
+        {0xF6, 0x33, 0}, {0xD6, 0x33, S}, {0xE4, 0x34, 0}, {0xC4, 0x34, S},  // ö Ö ä Ä
+        {'#', 0x32, 0}, {'\'', 0x32, S},
+        {0xB0, 0x35, S},                                                  // °
+        {',', 0x36, 0}, {';', 0x36, S}, {'.', 0x37, 0}, {':', 0x37, S},
+        {'-', 0x38, 0}, {'_', 0x38, S},
+        {'<', 0x64, 0}, {'>', 0x64, S}, {'|', 0x64, G},
+        {'@', 0x14, G}, {0xB5, 0x10, G},                                  // µ
+    });
+    return t;
+}
+
+constexpr layout_table make_fr() {
+    layout_table t{};
+    put_common(t);
+    put_digits(t, S);
+    put(t, {
+        {'a', 0x14, 0}, {'A', 0x14, S}, {'q', 0x04, 0}, {'Q', 0x04, S},   // AZERTY
+        {'z', 0x1A, 0}, {'Z', 0x1A, S}, {'w', 0x1D, 0}, {'W', 0x1D, S},
+        {'m', 0x33, 0}, {'M', 0x33, S},
+        {'&', 0x1E, 0}, {0xE9, 0x1F, 0}, {'"', 0x20, 0}, {'\'', 0x21, 0}, {'(', 0x22, 0},  // é
+        {'-', 0x23, 0}, {0xE8, 0x24, 0}, {'_', 0x25, 0}, {0xE7, 0x26, 0}, {0xE0, 0x27, 0}, // è ç à
+        {'#', 0x20, G}, {'{', 0x21, G}, {'[', 0x22, G}, {'|', 0x23, G},
+        {'\\', 0x25, G}, {'^', 0x26, G}, {'@', 0x27, G},
+        {')', 0x2D, 0}, {0xB0, 0x2D, S}, {']', 0x2D, G},                  // °
+        {'=', 0x2E, 0}, {'+', 0x2E, S}, {'}', 0x2E, G},
+        {'$', 0x30, 0}, {0xA3, 0x30, S}, {0xA4, 0x30, G},                 // £ ¤
+        {0xF9, 0x34, 0}, {'%', 0x34, S},                                  // ù
+        {'*', 0x32, 0}, {0xB5, 0x32, S},                                  // µ
+        {0xB2, 0x35, 0},                                                  // ²
+        {',', 0x10, 0}, {'?', 0x10, S}, {';', 0x36, 0}, {'.', 0x36, S},
+        {':', 0x37, 0}, {'/', 0x37, S}, {'!', 0x38, 0}, {0xA7, 0x38, S},  // §
+        {'<', 0x64, 0}, {'>', 0x64, S},
+    });
+    return t;
+}
+
+// indexed by kbd_layout
+constexpr layout_table kLayouts[KBD_LAYOUT_COUNT] = {
+    make_us(),
+    make_uk(),
+    make_de(),
+    make_fr(),
+};
+
+// euro sign (U+20AC) is outside Latin-1, so it gets its own entry per layout
+constexpr key_stroke kEuro[KBD_LAYOUT_COUNT] = {
+    {0x00, 0},   // us: none
+    {0x21, G},   // uk: AltGr+4
+    {0x08, G},   // de: AltGr+E
+    {0x08, G},   // fr: AltGr+E
+};
+
+static_assert(kLayouts[static_cast<size_t>(kbd_layout::us)]['A'].modifier == S, "US table must shift capitals");
+static_assert(kLayouts[static_cast<size_t>(kbd_layout::de)]['z'].keycode == 0x1C, "DE table must be QWERTZ");
+static_assert(kLayouts[static_cast<size_t>(kbd_layout::fr)]['1'].modifier == S, "FR digits need shift");
+
+} // namespace
+
+bool layout_valid(uint8_t id) {
+    return id < KBD_LAYOUT_COUNT;
+}
+
+const layout_table& layout_get(kbd_layout l) {
+    uint8_t id = static_cast<uint8_t>(l);
+    return kLayouts[layout_valid(id) ? id : 0];
+}
+
+key_stroke layout_lookup(kbd_layout l, uint32_t cp) {
+    if (cp < 256) return layout_get(l)[cp];
+    uint8_t id = static_cast<uint8_t>(l);
+    if (cp == 0x20AC && layout_valid(id)) return kEuro[id];
+    return key_stroke{0, 0};
+}
+
+const char* layout_to_str(kbd_layout l) {
+    switch (l) {
+        case kbd_layout::us: return "us";
+        case kbd_layout::uk: return "uk";
+        case kbd_layout::de: return "de";
+        case kbd_layout::fr: return "fr";
+    }
+    return "us";
+}
+
+size_t utf8_decode(const char* s, size_t n, uint32_t& cp) {
+    if (n == 0) {
+        cp = 0xFFFD;
+        return 0;
+    }
+
+    const uint8_t* b = reinterpret_cast<const uint8_t*>(s);
+    size_t len;
+    uint32_t min;
+    if (b[0] < 0x80) {
+        cp = b[0];
+        return 1;
+    } else if ((b[0] & 0xE0) == 0xC0) {
+        len = 2; cp = b[0] & 0x1F; min = 0x80;
+    } else if ((b[0] & 0xF0) == 0xE0) {
+        len = 3; cp = b[0] & 0x0F; min = 0x800;
+    } else if ((b[0] & 0xF8) == 0xF0) {
+        len = 4; cp = b[0] & 0x07; min = 0x10000;
+    } else {
+        cp = 0xFFFD;
+        return 1;
+    }
+
+    if (n < len) {
+        cp = 0xFFFD;
+        return 1;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if ((b[i] & 0xC0) != 0x80) {
+            cp = 0xFFFD;
+            return 1;
+        }
+        cp = (cp << 6) | (b[i] & 0x3F);
+    }
+    if (cp < min || cp > 0x10FFFF) cp = 0xFFFD;
+    return len;
+}
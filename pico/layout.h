@@ -0,0 +1,53 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// HID keyboard modifier bits (first byte of the keyboard report)
+constexpr uint8_t HID_MOD_LSHIFT = 0x02;
+constexpr uint8_t HID_MOD_RALT = 0x40;   // AltGr on ISO layouts
+
+/**
+ * Key (and modifiers) that produce a character on a given host keyboard layout.
+ * keycode == 0 means the character cannot be typed on that layout.
+ */
+struct key_stroke {
+    uint8_t keycode;
+    uint8_t modifier;
+};
+
+/**
+ * Host keyboard layouts text can be typed for. The value is what goes over the wire (CMD_SET_LAYOUT).
+ */
+enum class kbd_layout : uint8_t {
+    us = 0,
+    uk = 1,
+    de = 2,
+    fr = 3,
+};
+
+constexpr size_t KBD_LAYOUT_COUNT = 4;
+
+// One entry per Latin-1 code point (U+0000 - U+00FF).
+using layout_table = std::array<key_stroke, 256>;
+
+/**
+ * Lookup table for a layout, generated at compile time. Unknown values fall back to US.
+ */
+const layout_table& layout_get(kbd_layout l);
+
+/**
+ * Key stroke for a Unicode code point on a layout. Code points outside Latin-1 are not typeable,
+ * except for the euro sign where the layout has one.
+ */
+key_stroke layout_lookup(kbd_layout l, uint32_t cp);
+
+bool layout_valid(uint8_t id);
+const char* layout_to_str(kbd_layout l);
+
+/**
+ * Decodes one UTF-8 sequence from s[0..n).
+ * Returns the number of bytes consumed (at least 1 if n > 0). Malformed or truncated input
+ * consumes one byte and decodes to U+FFFD.
+ */
+size_t utf8_decode(const char* s, size_t n, uint32_t& cp);
@@ -3,6 +3,10 @@
 #include "log.h"
 #include "httpd.h"
 #include "bt.h"
+#include "typist.h"
+#include "scheduler.h"
+#include "core_load.h"
+#include "kv_store.h"
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include "hardware/watchdog.h"
@@ -11,79 +15,118 @@ using namespace std;
 
 app_state as;
 
-// --- ASCII to HID keycode conversion ---
-static uint8_t ascii_to_hid(char c) {
-    if (c >= 'a' && c <= 'z') return 0x04 + (c - 'a');  // a-z
-    if (c >= 'A' && c <= 'Z') return 0x04 + (c - 'A');  // A-Z (same as lowercase, shift handled separately)
-    if (c >= '1' && c <= '9') return 0x1E + (c - '1');  // 1-9
-    if (c == '0') return 0x27;                           // 0
-    if (c == ' ') return 0x2C;                           // Space
-    if (c == '.') return 0x37;                           // .
-    if (c == ',') return 0x36;                           // ,
-    if (c == '\n') return 0x28;                          // Enter
-    if (c == '\t') return 0x2B;                          // Tab
-    if (c == '\r') return 0x28;                          // Enter
-    return 0;  // unsupported character
-}
-
 // --- dashboard ---
 
+scheduler sched;
+
 void led_put(bool on) {
     cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, on);
 }
 
-void led_blink(int times, int delay_ms) {
-    for (int i = 0; i < times; i++) {
-        led_put(true);
-        sleep_ms(delay_ms);
-        led_put(false);
-        sleep_ms(delay_ms);
+// LED pattern: on/off durations in ms, alternating, starting with on
+struct led_pattern {
+    const uint16_t *steps;
+    size_t len;
+};
+
+static const uint16_t LED_STEPS_CONNECTING[] = {500, 500, 500, 500, 500, 500};
+static const uint16_t LED_STEPS_IDLE[] = {2000, 2000};
+static const uint16_t LED_STEPS_SOS[] = {
+    200, 200, 200, 200, 200, 600,   // S
+    600, 200, 600, 200, 600, 600,   // O
+    200, 200, 200, 200, 200, 1000,  // S, wait before repeating
+};
+
+#define LED_PATTERN(steps) led_pattern{steps, sizeof(steps) / sizeof(steps[0])}
+static const led_pattern LED_CONNECTING = LED_PATTERN(LED_STEPS_CONNECTING);  // joining Wi-Fi
+static const led_pattern LED_IDLE = LED_PATTERN(LED_STEPS_IDLE);              // up and running
+static const led_pattern LED_SOS = LED_PATTERN(LED_STEPS_SOS);
+
+// pattern being played by the scheduler
+static struct {
+    led_pattern pattern{};
+    bool repeat{false};
+    size_t step{0};
+    int task{-1};
+} led;
+
+static void led_step() {
+    if (led.step == led.pattern.len) {
+        if (!led.repeat) {
+            led.task = -1;
+            return;
+        }
+        led.step = 0;
     }
+    led_put(led.step % 2 == 0);
+    uint16_t ms = led.pattern.steps[led.step++];
+    led.task = sched.after("led", ms, led_step);
 }
 
+// Plays a pattern from the scheduler, replacing the current one. Doesn't block.
+void led_play(const led_pattern& pattern, bool repeat) {
+    sched.cancel(led.task);
+    led.pattern = pattern;
+    led.repeat = repeat;
+    led.step = 0;
+    led_step();
+}
+
+// Only for when the wireless chip (and its async context) failed to come up.
 void led_blink_sos_forever() {
     while (true) {
-        // S
-        led_put(true);
-        sleep_ms(200);
-        led_put(false);
-        sleep_ms(200);
-        led_put(true);
-        sleep_ms(200);
-        led_put(false);
-        sleep_ms(200);
-        led_put(true);
-        sleep_ms(200);
-        led_put(false);
-        sleep_ms(600);
-
-        // O
-        led_put(true);
-        sleep_ms(600);
-        led_put(false);
-        sleep_ms(200);
-        led_put(true);
-        sleep_ms(600);
-        led_put(false);
-        sleep_ms(200);
-        led_put(true);
-        sleep_ms(600);
-        led_put(false);
-        sleep_ms(600);
-
-        // S
-        led_put(true);
-        sleep_ms(200);
-        led_put(false);
-        sleep_ms(200);
-        led_put(true);
-        sleep_ms(200);
-        led_put(false);
-        sleep_ms(200);
-        led_put(true);
-        sleep_ms(200);
-        led_put(false);
-        sleep_ms(1000); // wait before repeating
+        for (size_t i = 0; i < LED_SOS.len; i++) {
+            led_put(i % 2 == 0);
+            sleep_ms(LED_SOS.steps[i]);
+        }
+    }
+}
+
+// Busy share of each core since the previous call, marks stats dirty if it moved.
+void update_core_load() {
+    static uint32_t last_us = time_us_32();
+    static uint32_t last_busy[2] = {};
+    uint32_t now = time_us_32();
+    uint32_t dt = now - last_us;
+    last_us = now;
+    for (int core = 0; core < 2; core++) {
+        uint32_t busy = g_core_load[core].busy_us.load(std::memory_order_relaxed);
+        uint16_t pm = dt > 0 ? (uint16_t)((uint64_t)(busy - last_busy[core]) * 1000 / dt) : 0;
+        last_busy[core] = busy;
+        if (pm != as.core_load_pm[core]) {
+            as.core_load_pm[core] = pm;
+            as.mark(APP_DIRTY_STATS);
+        }
+    }
+}
+
+// Takes the scheduler lag window, marks stats dirty if it moved.
+void update_loop_stats() {
+    scheduler::lag_stats l = sched.take_lag();
+    if (l.max_us != as.loop_lag_us || l.peak_us != as.loop_lag_peak_us || l.avg_us != as.loop_lag_avg_us) {
+        as.loop_lag_us = l.max_us;
+        as.loop_lag_peak_us = l.peak_us;
+        as.loop_lag_avg_us = l.avg_us;
+        as.mark(APP_DIRTY_STATS);
+    }
+}
+
+// Copies the settings store and flash stall figures, marks stats dirty if they moved.
+void update_store_stats() {
+    const kv_store::stats_t& s = g_kv_store.stats();
+    const flash_stats& f = flash_get_stats();
+    uint32_t pending = (uint32_t)g_kv_store.pending();
+    if (pending != as.store_pending || f.programs != as.store_programs || f.erases != as.store_erases ||
+        s.failed != as.store_failed || s.used != as.store_used || f.last_stall_us != as.store_stall_last_us ||
+        f.max_stall_us != as.store_stall_max_us) {
+        as.store_pending = pending;
+        as.store_programs = f.programs;
+        as.store_erases = f.erases;
+        as.store_failed = s.failed;
+        as.store_used = s.used;
+        as.store_stall_last_us = f.last_stall_us;
+        as.store_stall_max_us = f.max_stall_us;
+        as.mark(APP_DIRTY_STATS);
     }
 }
 
@@ -103,24 +146,21 @@ int main() {
         led_blink_sos_forever();
     }
 
-    led_blink(5, 100);  // indicate that the chip was initialized successfully
+    // timers and LED patterns run on the cyw43 async context from here on
+    sched.init(cyw43_arch_async_context());
 
-    // http startup
-    httpd h{as};
-    h.init();
-    while(!h.is_connected) {
-        h.connect();
+    // central names and preferences, read before Bluetooth needs them
+    g_kv_store.init();
 
-        if(!h.is_connected) {
-            led_blink(3, 500);
-        }
-    }
-    h.start();
-
-    // bt startup
     bt b{as};
     b.init();
-    b.start();
+    httpd h{as};
+    h.init();
+
+    // push BT changes (connects, names, advertising) the moment they happen
+    b.on_state_change = [&h]() {
+        h.notify_changes();
+    };
 
     h.cmd_kbd_report = [&b](const uint8_t report[8]) {
         b.send_key_report(report);
@@ -130,10 +170,30 @@ int main() {
         b.send_mouse_report(report);
     };
 
+    h.cmd_mouse_wide = [&b](uint8_t buttons, int16_t dx, int16_t dy, int8_t wheel, int8_t pan) {
+        b.send_mouse_wide_report(buttons, dx, dy, wheel, pan);
+    };
+
+    h.cmd_mouse_abs = [&b](uint8_t buttons, uint16_t x, uint16_t y) {
+        b.send_mouse_abs_report(buttons, x, y);
+    };
+
+    h.cmd_kbd_report_to = [&b](uint16_t central_id, const uint8_t report[8]) {
+        b.send_key_report_to(central_id, report);
+    };
+
+    h.cmd_mouse_report_to = [&b](uint16_t central_id, const uint8_t report[4]) {
+        b.send_mouse_report_to(central_id, report);
+    };
+
     h.cmd_bt_adv_toggle = [&b]() {
         b.adv_toggle();
     };
 
+    h.cmd_bt_broadcast = [&b](bool on) {
+        b.set_broadcast(on);
+    };
+
     h.cmd_bt_central_activate = [&b](uint16_t central_id) {
         b.activate_central(central_id);
         b.update_as();
@@ -143,51 +203,106 @@ int main() {
         b.unpair_central(central_id);
     };
 
-    h.cmd_type = [&b](const string& text) {
+    // typing engine on core 1, everything else stays on core 0 with the cyw43 async context
+    typist t{b};
+    t.start(cyw43_arch_async_context());
+    b.on_report_sent = [&t]() {
+        t.pump();
+    };
+    t.on_progress = [&h](const typist::progress& p) {
+        h.notify_typing(p.done, p.total, p.reports, p.cps, typist::state_to_str(p.st));
+    };
+
+    h.cmd_type = [&t](const string& text) {
         if (log_enabled()) log("Received text to type: %s", text.c_str());
-        for (char c : text) {
-            uint8_t hid_code = ascii_to_hid(c);
-            if (hid_code != 0) {
-                b.send_key_press(hid_code);
-                sleep_ms(10);  // Small delay between keypresses
-            }
+        t.type(text);
+    };
+
+    h.cmd_type_cancel = [&t]() {
+        t.cancel();
+    };
+
+    h.cmd_set_layout = [&t](uint8_t layout) {
+        if (!layout_valid(layout)) {
+            if (log_enabled()) log("Unknown keyboard layout %u", layout);
+            return;
         }
+        t.layout = static_cast<kbd_layout>(layout);
+        as.kbd_layout = layout_to_str(t.layout);
+        as.mark(APP_DIRTY_KBD);
+    };
+
+    h.cmd_set_type_mode = [&t](uint8_t mode) {
+        t.typing_mode = mode ? typist::mode::rollover : typist::mode::single;
+        as.type_rollover = t.typing_mode == typist::mode::rollover;
+        as.mark(APP_DIRTY_KBD);
     };
 
     h.cmd_reboot = []() {
         if (log_enabled()) log("Rebooting...");
-        sleep_ms(1000);
-        watchdog_reboot(0, 0, 0);
+        sched.after("reboot", 1000, []() {
+            g_kv_store.commit();  // settings changed since the last idle window
+            watchdog_reboot(0, 0, 0);
+        });
     };
 
-    // Timer for periodic state updates (uptime, BT name, etc.)
-    absolute_time_t next_notify_time = get_absolute_time();
-    const int NOTIFY_INTERVAL_MS = 5000;  // Send updates every 5 seconds
+    // Bluetooth powers up right away, so bonded hosts can reconnect while Wi-Fi is still joining
+    // (or if it never does). The join runs in the background, the servers start once it went through.
+    b.start();
+    led_play(LED_CONNECTING, true);
+    h.connect();
+    // Wi-Fi supervisor, for good: rejoins in the background whenever the link drops, Bluetooth carries on meanwhile.
+    // Polled often enough that a fast join to the cached access point isn't held up by it.
+    sched.every("wifi", 100, [&h]() {
+        bool was_connected = h.is_connected;
+        h.supervise();
+        if (h.is_connected != was_connected) led_play(h.is_connected ? LED_IDLE : LED_CONNECTING, true);
+    });
 
-    while (true) {
+    // Settings go to flash in idle windows: every page program holds both cores (and BTstack, lwIP) for a
+    // moment, so changes wait until no text is being typed and HID input has been quiet for a while.
+    // Someone typing for a minute straight still gets them written, between two reports.
+    // A failed commit is tried again later, twice as late after each failure in a row, so broken flash doesn't
+    // stall both cores every round. Entries that don't fit a sector aren't tried again until something shrinks.
+    uint32_t commit_backoff_ms = 0;
+    absolute_time_t commit_retry_at{};
+    sched.every("persist", 500, [&b, &t, &commit_backoff_ms, &commit_retry_at]() {
+        if (g_kv_store.pending() == 0 || g_kv_store.full()) return;
+        if (commit_backoff_ms && absolute_time_diff_us(get_absolute_time(), commit_retry_at) > 0) return;
+        bool idle = b.input_idle_ms() >= KV_COMMIT_IDLE_MS && !t.busy() && b.hid_queue_stats().depth == 0;
+        if (!idle && g_kv_store.pending_ms() < KV_COMMIT_MAX_DELAY_MS) return;
+        if (g_kv_store.commit()) {
+            commit_backoff_ms = 0;
+        } else {
+            commit_backoff_ms = !commit_backoff_ms ? KV_RETRY_MIN_MS
+                : commit_backoff_ms * 2 < KV_RETRY_MAX_MS ? commit_backoff_ms * 2 : KV_RETRY_MAX_MS;
+            commit_retry_at = make_timeout_time_ms(commit_backoff_ms);
+            if (log_enabled()) log("kv: commit failed, next attempt in %u ms", (unsigned)commit_backoff_ms);
+        }
+        update_store_stats();
+    });
+
+    // Heartbeat: uptime plus stats, if they moved. Everything else is pushed as it changes.
+    // Scheduler tasks run in the async context, already serialized with lwIP and BTstack.
+    const uint32_t NOTIFY_INTERVAL_MS = 5000;
+    sched.every("heartbeat", NOTIFY_INTERVAL_MS, [&b, &h]() {
+        b.update_stats();
+        update_loop_stats();
+        update_core_load();
+        update_store_stats();
+        h.sample_stats();
+        h.notify_changes();
+        h.heartbeat();
+    });
 
+    // All work is done by the async context: scheduled tasks on their alarms, lwIP and BTstack on their
+    // interrupts. The core sleeps until the next one.
+    while (true) {
 #if PICO_CYW43_ARCH_POLL
         cyw43_arch_poll();
-        cyw43_arch_wait_for_work_until(led_time);
+        cyw43_arch_wait_for_work_until(at_the_end_of_time);
 #else
-        // sleep_ms(1000);
-        led_blink(1, 2000);
+        __wfi();
 #endif
-
-        // Send periodic updates to WebSocket client
-        absolute_time_t now = get_absolute_time();
-        if (absolute_time_diff_us(next_notify_time, now) >= 0) {
-            cyw43_arch_lwip_begin();
-            h.notify();
-            cyw43_arch_lwip_end();
-            next_notify_time = delayed_by_ms(now, NOTIFY_INTERVAL_MS);
-        }
-
-        // log("Hydra [%s] %s:%s", VTAG, WIFI_SSID, WIFI_PASSWORD);
-
-        // cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 1);
-        // sleep_ms(500);
-        // cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 0);
-        // sleep_ms(500);
     }
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -8,11 +9,62 @@ struct app_bt_central {
     bool is_active;
     std::string addr;
     std::string addr_type;
+    uint32_t conn_interval_us;
+    uint16_t conn_latency;
+    uint32_t reports_sent;
+    uint32_t reports_dropped;
+};
+
+// Advertising phase, see bt::adv_restart.
+enum class app_adv_phase : uint8_t { off, directed, fast, slow };
+
+// Parts of app_state that changed since the last notification, see app_state::mark.
+enum : uint32_t {
+    APP_DIRTY_BT_ADV       = 1u << 0,  // is_advertising, bt_adv_phase
+    APP_DIRTY_BT_BROADCAST = 1u << 1,  // bt_broadcast
+    APP_DIRTY_CENTRALS     = 1u << 2,  // bt_centrals (connect, disconnect, name, active, link stats)
+    APP_DIRTY_KBD          = 1u << 3,  // kbd_layout, type_rollover
+    APP_DIRTY_STATS        = 1u << 4,  // hid queue, command counters, loop lag and boot milestones
 };
 
 struct app_state {
     bool is_advertising{false};
+    app_adv_phase bt_adv_phase{app_adv_phase::off};
+    bool bt_broadcast{false};
     int bt_central_count{0};
     std::vector<app_bt_central> bt_centrals;
-    std::string bt_centrals_json_array;
+    std::string kbd_layout{"us"};
+    bool type_rollover{false};
+    uint32_t hid_queue_depth{0};
+    uint32_t hid_queue_high_water{0};
+    uint32_t hid_queue_overflows{0};
+    uint32_t loop_lag_us{0};       // worst scheduler lag over the last stats period
+    uint32_t loop_lag_peak_us{0};  // worst since boot
+    uint32_t loop_lag_avg_us{0};
+    uint16_t core_load_pm[2]{};    // busy share of each core over the last stats period, per mille
+
+    // settings store: changes waiting for an idle window, flash work since boot
+    uint32_t store_pending{0};        // keys changed but not committed yet
+    uint32_t store_programs{0};       // flash page programs
+    uint32_t store_erases{0};         // flash sector erases
+    uint32_t store_failed{0};         // settings commits that failed
+    uint32_t store_used{0};           // bytes in use in the active sector
+    uint32_t store_stall_last_us{0};  // both cores locked out by the last flash operation
+    uint32_t store_stall_max_us{0};   // worst since boot
+
+    // boot milestones in ms since power-on, 0 until reached
+    uint32_t boot_bt_ms{0};            // Bluetooth stack up and advertising
+    uint32_t boot_wifi_ms{0};          // Wi-Fi joined with an IP address
+    uint32_t boot_first_report_ms{0};  // first HID report delivered to a host
+    uint32_t boot_central_ms{0};       // first central connected (a bonded host coming back, usually)
+    uint32_t boot_ws_ms{0};            // WebSocket server listening
+    bool boot_wifi_fast{false};        // Wi-Fi joined the cached access point, without a scan
+
+    uint32_t version{0};  // bumped by every change
+    uint32_t dirty{0};    // APP_DIRTY_* bits not notified yet
+
+    void mark(uint32_t what) {
+        dirty |= what;
+        version++;
+    }
 };
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include "scheduler.h"
+#include "log.h"
+#include "core_load.h"
+
+using namespace std;
+
+void scheduler::init(async_context_t *ctx) {
+    ctx_ = ctx;
+}
+
+int scheduler::every(const char *name, uint32_t interval_ms, task_fn fn, uint32_t delay_ms) {
+    return add(name, delay_ms, interval_ms, std::move(fn));
+}
+
+int scheduler::after(const char *name, uint32_t delay_ms, task_fn fn) {
+    return add(name, delay_ms, 0, std::move(fn));
+}
+
+int scheduler::add(const char *name, uint32_t delay_ms, uint32_t interval_ms, task_fn fn) {
+    async_context_acquire_lock_blocking(ctx_);
+    int id = -1;
+    for (size_t i = 0; i < SCHED_MAX_TASKS; i++) {
+        if (!tasks_[i].used) {
+            id = (int)i;
+            break;
+        }
+    }
+    if (id < 0) {
+        async_context_release_lock(ctx_);
+        if (log_enabled()) log("scheduler: no free slot for %s", name);
+        return -1;
+    }
+
+    task& t = tasks_[id];
+    t.worker.do_work = run;
+    t.worker.user_data = &t;
+    t.sched = this;
+    t.name = name;
+    t.fn = std::move(fn);
+    t.interval_ms = interval_ms;
+    t.due = make_timeout_time_ms(delay_ms);
+    t.used = true;
+    async_context_add_at_time_worker_at(ctx_, &t.worker, t.due);
+    async_context_release_lock(ctx_);
+    return id;
+}
+
+void scheduler::cancel(int id) {
+    if (id < 0 || id >= (int)SCHED_MAX_TASKS) return;
+    async_context_acquire_lock_blocking(ctx_);
+    task& t = tasks_[id];
+    if (t.used) {
+        async_context_remove_at_time_worker(ctx_, &t.worker);
+        t.fn = nullptr;
+        t.used = false;
+    }
+    async_context_release_lock(ctx_);
+}
+
+scheduler::lag_stats scheduler::take_lag() {
+    async_context_acquire_lock_blocking(ctx_);
+    lag_stats s{runs_, lag_last_us_, lag_max_us_, lag_peak_us_, runs_ > 0 ? (uint32_t)(lag_total_us_ / runs_) : 0};
+    lag_max_us_ = 0;
+    async_context_release_lock(ctx_);
+    return s;
+}
+
+// at-time worker callback, runs in the async context
+void scheduler::run(async_context_t *ctx, async_at_time_worker_t *worker) {
+    busy_scope busy;
+    task& t = *static_cast<task*>(worker->user_data);
+    scheduler& s = *t.sched;
+    absolute_time_t now = get_absolute_time();
+
+    int64_t lag = absolute_time_diff_us(t.due, now);
+    uint32_t lag_us = lag > 0 ? (uint32_t)lag : 0;
+    s.runs_++;
+    s.lag_last_us_ = lag_us;
+    s.lag_total_us_ += lag_us;
+    if (lag_us > s.lag_max_us_) s.lag_max_us_ = lag_us;
+    if (lag_us > s.lag_peak_us_) s.lag_peak_us_ = lag_us;
+
+    if (t.interval_ms > 0) {
+        // rearm before running, so fn may cancel its own task
+        t.due = delayed_by_ms(t.due, t.interval_ms);
+        if (absolute_time_diff_us(now, t.due) < 0) {
+            // fell more than an interval behind, skip the missed runs instead of bursting
+            if (log_enabled()) log("scheduler: %s late by %u us", t.name, lag_us);
+            t.due = delayed_by_ms(now, t.interval_ms);
+        }
+        async_context_add_at_time_worker_at(ctx, &t.worker, t.due);
+
+        // held outside the slot while it runs, in case fn cancels the task or the slot gets reused
+        task_fn fn = std::move(t.fn);
+        fn();
+        if (t.used && !t.fn) t.fn = std::move(fn);
+    } else {
+        // the slot is free again while fn runs, fn may schedule a follow-up into it
+        task_fn fn = std::move(t.fn);
+        t.fn = nullptr;
+        t.used = false;
+        fn();
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "pico/stdlib.h"
+#include "pico/async_context.h"
+#include <cstdint>
+#include <functional>
+
+// most tasks (periodic and pending one-shot) scheduled at once
+constexpr size_t SCHED_MAX_TASKS = 8;
+
+/**
+ * Timer/task scheduler on top of an async_context (the cyw43 one).
+ * Each task is an at-time worker, so it runs under the same lock as the lwIP and BTstack callbacks
+ * (no cyw43_arch_lwip_begin() needed inside) and the core sleeps until the next deadline in between.
+ * Periodic tasks keep a fixed rate: the next run is due one interval after the previous due time,
+ * not after the previous run, so lag doesn't accumulate.
+ * Lag (how late a task started compared to its due time) is tracked over all runs.
+ */
+class scheduler {
+public:
+    using task_fn = std::function<void()>;
+
+    struct lag_stats {
+        uint32_t runs;    // task runs
+        uint32_t last_us; // lag of the latest run
+        uint32_t max_us;  // worst lag since the previous take_lag()
+        uint32_t peak_us; // worst lag since boot
+        uint32_t avg_us;  // mean lag since boot
+    };
+
+    void init(async_context_t *ctx);
+
+    // Runs fn every interval_ms, the first time after delay_ms. Returns the task id, -1 if the table is full.
+    int every(const char *name, uint32_t interval_ms, task_fn fn, uint32_t delay_ms = 0);
+
+    // Runs fn once after delay_ms. Returns the task id, -1 if the table is full.
+    int after(const char *name, uint32_t delay_ms, task_fn fn);
+
+    // Stops a task. Safe for ids already run or cancelled, as long as the slot wasn't reused.
+    void cancel(int id);
+
+    // Lag so far, starts a new window for max_us.
+    lag_stats take_lag();
+
+private:
+    struct task {
+        async_at_time_worker_t worker{};
+        scheduler *sched{nullptr};
+        const char *name{nullptr};
+        task_fn fn;
+        uint32_t interval_ms{0};  // 0: one-shot
+        absolute_time_t due{};
+        bool used{false};
+    };
+
+    async_context_t *ctx_{nullptr};
+    task tasks_[SCHED_MAX_TASKS];
+
+    uint32_t runs_{0};
+    uint32_t lag_last_us_{0};
+    uint32_t lag_max_us_{0};
+    uint32_t lag_peak_us_{0};
+    uint64_t lag_total_us_{0};
+
+    int add(const char *name, uint32_t delay_ms, uint32_t interval_ms, task_fn fn);
+    static void run(async_context_t *ctx, async_at_time_worker_t *worker);
+};
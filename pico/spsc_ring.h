@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Fixed-capacity, lock-free single-producer / single-consumer ring buffer.
+ * - push() must only be called by the producer, front() / pop() / clear() only by the consumer.
+ * - Items are copied in, so the producer can reuse its buffers straight after push().
+ * - head and tail are free-running counters, capacity must be a power of two.
+ * - overflows() counts rejected pushes, high_water() is the deepest the ring has ever been.
+ */
+template <typename T, size_t N>
+class spsc_ring {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "spsc_ring capacity must be a power of two");
+
+public:
+    static constexpr size_t capacity = N;
+
+    bool push(const T& item) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        if (head - tail >= N) {
+            overflows_.store(overflows_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        buf_[head & (N - 1)] = item;
+        head_.store(head + 1, std::memory_order_release);
+
+        uint32_t depth = head + 1 - tail;
+        if (depth > high_water_.load(std::memory_order_relaxed)) {
+            high_water_.store(depth, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Oldest item, or nullptr when empty. Stays valid until pop().
+    T* front() {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) return nullptr;
+        return &buf_[tail & (N - 1)];
+    }
+
+    void pop() {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) return;
+        tail_.store(tail + 1, std::memory_order_release);
+    }
+
+    // Drops everything currently queued.
+    void clear() {
+        tail_.store(head_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    uint32_t overflows() const { return overflows_.load(std::memory_order_relaxed); }
+    uint32_t high_water() const { return high_water_.load(std::memory_order_relaxed); }
+
+private:
+    T buf_[N];
+    std::atomic<uint32_t> head_{0};  // written by producer
+    std::atomic<uint32_t> tail_{0};  // written by consumer
+    std::atomic<uint32_t> overflows_{0};
+    std::atomic<uint32_t> high_water_{0};
+};
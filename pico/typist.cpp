@@ -0,0 +1,234 @@
+#include "typist.h"
+#include "core_load.h"
+#include "log.h"
+#include "pico/multicore.h"
+#include <string.h>
+
+using namespace std;
+
+typist* typist::g_typist{nullptr};
+
+// number of code points in UTF-8 text (every byte that is not a continuation byte)
+static uint32_t utf8_count(const char* t, size_t n) {
+    uint32_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if ((static_cast<uint8_t>(t[i]) & 0xC0) != 0x80) count++;
+    }
+    return count;
+}
+
+// ---- core 0 ----
+
+void typist::start(async_context_t *c) {
+    g_typist = this;
+    ctx = c;
+    pump_worker.do_work = pump_work;
+    pump_worker.user_data = this;
+    async_context_add_when_pending_worker(ctx, &pump_worker);
+    multicore_launch_core1(core1_main);
+}
+
+void typist::type(const string& t) {
+    if (t.empty()) return;
+    if (!running) {
+        running = true;
+        chars_done = 0;
+        chars_total = 0;
+        reports_sent = 0;
+        started = get_absolute_time();
+        last_progress = started;
+    }
+
+    // chunks end on code point boundaries, so core 1 never sees a sequence cut in two
+    chunk c;
+    c.run = run.load(memory_order_relaxed);
+    size_t i = 0;
+    while (i < t.size()) {
+        size_t n = t.size() - i < TYPIST_CHUNK_SIZE ? t.size() - i : TYPIST_CHUNK_SIZE;
+        while (n < t.size() - i && n > 1 && (static_cast<uint8_t>(t[i + n]) & 0xC0) == 0x80) n--;
+        c.len = (uint8_t)n;
+        memcpy(c.text, t.data() + i, n);
+        if (!chunks.push(c)) break;
+        chars_total += utf8_count(c.text, n);
+        i += n;
+    }
+    if (i < t.size() && log_enabled()) log("typist: queue full, dropping %u bytes", (unsigned)(t.size() - i));
+
+    wake_core1();
+}
+
+void typist::cancel() {
+    if (!busy()) return;
+    if (log_enabled()) log("typist: cancelled after %u of %u characters", chars_done, chars_total);
+    drop_run();
+}
+
+// Ends the run as cancelled: core 1 drops the text of older runs, pump() their strokes.
+void typist::drop_run() {
+    run.store(run.load(memory_order_relaxed) + 1, memory_order_release);
+    wake_core1();
+    finish(state::cancelled);
+}
+
+void typist::pump() {
+    uint32_t r = run.load(memory_order_relaxed);
+    bool took = false;
+    while (b.hid_queue_stats().depth + 2 <= TYPIST_MAX_QUEUED) {
+        stroke* s = strokes.front();
+        if (!s) break;
+        if (s->run == r && running) {
+            // press and release go in together, so a cancelled run never leaves a key held down
+            if (s->press) {
+                if (!b.send_key_report(s->rpt)) {
+                    strokes.pop();
+                    drop_run();
+                    return;
+                }
+                uint8_t rpt[8];
+                hid_kbd_rpt_set_keycode(rpt, 0);
+                b.send_key_report(rpt);
+                reports_sent += 2;
+            }
+            chars_done += s->chars;
+        }
+        strokes.pop();
+        took = true;
+    }
+    if (took) wake_core1();  // room in the stroke ring again
+
+    if (!running) return;
+    if (busy()) {
+        absolute_time_t now = get_absolute_time();
+        if (absolute_time_diff_us(last_progress, now) >= TYPIST_PROGRESS_INTERVAL_MS * 1000) {
+            last_progress = now;
+            report(state::typing);
+        }
+        return;
+    }
+
+    // report completion only once the last release went over the air, so cps is honest
+    if (b.hid_queue_stats().depth == 0) finish(state::done);
+}
+
+// core 1 waits for events, SEV is its doorbell (the SIO FIFO belongs to the flash lockout)
+void typist::wake_core1() {
+    __sev();
+}
+
+void typist::pump_work(async_context_t *, async_when_pending_worker_t *worker) {
+    busy_scope busy;
+    static_cast<typist*>(worker->user_data)->pump();
+}
+
+void typist::report(state st) {
+    if (!on_progress) return;
+    int64_t elapsed_ms = absolute_time_diff_us(started, get_absolute_time()) / 1000;
+    uint32_t cps = elapsed_ms > 0 ? (uint32_t)((uint64_t)chars_done * 1000 / elapsed_ms) : 0;
+    on_progress(progress{chars_done, chars_total, reports_sent, cps, st});
+}
+
+void typist::finish(state st) {
+    running = false;
+    report(st);
+}
+
+const char* typist::state_to_str(state st) {
+    switch (st) {
+        case state::idle: return "idle";
+        case state::typing: return "typing";
+        case state::done: return "done";
+        case state::cancelled: return "cancelled";
+    }
+    return "unknown";
+}
+
+// ---- core 1 ----
+
+void typist::core1_main() {
+    // lets core 0 park this core in RAM while it writes flash (BTstack bonding data, flash_page.h)
+    multicore_lockout_victim_init();
+    g_typist->engine();
+}
+
+// Keeps the stroke ring full while there is text, sleeps in between.
+void typist::engine() {
+    while (true) {
+        {
+            busy_scope busy;
+            bool produced = false;
+            stroke s;
+            // only the consumer shrinks the ring, so size() can't undercount here
+            while (strokes.size() < TYPIST_STROKE_RING_SIZE && next_stroke(s)) {
+                strokes.push(s);
+                produced = true;
+            }
+            if (produced) async_context_set_work_pending(ctx, &pump_worker);
+        }
+        __wfe();
+    }
+}
+
+// Moves chunks of the current run from the ring into text while they fit, drops older ones.
+void typist::fill() {
+    while (chunk* c = chunks.front()) {
+        if ((int32_t)(c->run - text_run) < 0) {
+            chunks.pop();  // typed before a cancel
+            continue;
+        }
+        if (c->run != text_run || text_len + c->len > sizeof(text)) break;
+        memcpy(text + text_len, c->text, c->len);
+        text_len += c->len;
+        chunks.pop();
+    }
+}
+
+// Builds the next press report (keys packed per typing_mode). Returns false when there is no text left.
+bool typist::next_stroke(stroke& s) {
+    uint32_t r = run.load(memory_order_acquire);
+    if (r != text_run) {
+        text_len = 0;  // cancelled
+        text_run = r;
+    }
+    fill();
+    if (text_len == 0) return false;
+
+    const kbd_layout l = layout.load(memory_order_relaxed);
+    const layout_table& table = layout_get(l);
+    const size_t max_keys = typing_mode.load(memory_order_relaxed) == mode::rollover ? 6 : 1;
+
+    uint8_t keys[6];
+    size_t nkeys = 0;
+    uint8_t modifier = 0;
+    size_t pos = 0;
+    uint16_t chars = 0;
+
+    while (pos < text_len && nkeys < max_keys) {
+        uint32_t cp;
+        size_t len = utf8_decode(text + pos, text_len - pos, cp);
+        key_stroke ks = cp < table.size() ? table[cp] : layout_lookup(l, cp);
+
+        if (ks.keycode != 0) {
+            // a key can't be pressed twice in one report, and all keys share the modifier byte
+            if (nkeys > 0 && ks.modifier != modifier) break;
+            bool repeat = false;
+            for (size_t i = 0; i < nkeys; i++) repeat |= (keys[i] == ks.keycode);
+            if (repeat) break;
+
+            modifier = ks.modifier;
+            keys[nkeys++] = ks.keycode;
+        }
+
+        // counted like core 0 counts them in type()
+        chars += utf8_count(text + pos, len);
+        pos += len;
+    }
+
+    memmove(text, text + pos, text_len - pos);
+    text_len -= pos;
+
+    s.run = r;
+    s.chars = chars;
+    s.press = nkeys > 0;  // only untypeable characters otherwise
+    if (s.press) hid_kbd_rpt_set_keys(s.rpt, modifier, keys, nkeys);
+    return true;
+}
@@ -0,0 +1,142 @@
+#pragma once
+#include "pico/stdlib.h"
+#include "pico/async_context.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include "bt.h"
+#include "layout.h"
+#include "spsc_ring.h"
+
+// text bytes carried by one entry of the core 0 -> core 1 text ring
+constexpr size_t TYPIST_CHUNK_SIZE = 27;
+
+// entries of the text ring (power of two), bounds the text waiting to be typed
+constexpr size_t TYPIST_TEXT_RING_SIZE = 128;
+
+// most text (in bytes) that can be waiting to be typed
+constexpr size_t TYPIST_MAX_TEXT = TYPIST_CHUNK_SIZE * TYPIST_TEXT_RING_SIZE;
+
+// key strokes core 1 may have ready ahead of the HID queue (power of two)
+constexpr size_t TYPIST_STROKE_RING_SIZE = 16;
+
+// how many of our reports may sit in the HID queue at once, leaves room for live keyboard/mouse input
+constexpr size_t TYPIST_MAX_QUEUED = 4;
+
+// minimum time between two progress notifications
+constexpr uint32_t TYPIST_PROGRESS_INTERVAL_MS = 250;
+
+/**
+ * Non-blocking typing engine, split across the two cores.
+ * Text is queued with type() on core 0 and handed to core 1 through a lock-free ring. Core 1 decodes it
+ * and turns it into key strokes (press reports, with shift/AltGr, through the selected layout), which go
+ * back to core 0 through a second ring. pump() runs on core 0 every time bt sent a report (HIDS
+ * CAN_SEND_NOW) or core 1 has new strokes, and moves strokes into the HID queue as press/release pairs,
+ * so characters go out as fast as the link allows and nothing ever sleeps inside the lwIP or BTstack
+ * callbacks. Core 1 sleeps in WFE and is woken by SEV (the SIO FIFO belongs to the flash lockout), an async
+ * context worker wakes core 0.
+ * In rollover mode runs of distinct keys with the same modifier are packed into one report (up to the
+ * 6 key slots of the keyboard report) and released together, so most characters cost one notification
+ * instead of two. Repeated keys and modifier changes fall back to a new report.
+ */
+class typist {
+public:
+    static typist* g_typist;
+
+    enum class state : uint8_t {
+        idle,
+        typing,
+        done,
+        cancelled,
+    };
+
+    enum class mode : uint8_t {
+        single = 0,    // one key per press report
+        rollover = 1,  // up to 6 distinct keys per press report
+    };
+
+    struct progress {
+        uint32_t done;     // characters typed so far
+        uint32_t total;    // characters in this run
+        uint32_t reports;  // keyboard reports queued for this run
+        uint32_t cps;      // characters per second since the run started
+        state st;
+    };
+
+    typist(bt& b) : b(b) {}
+
+    // Launches the engine on core 1, strokes are pumped from ctx on core 0.
+    void start(async_context_t *ctx);
+
+    /**
+     * Appends text to the queue and starts typing if idle.
+     * Text beyond TYPIST_MAX_TEXT is dropped.
+     */
+    void type(const std::string& text);
+
+    // Drops everything not typed yet. Keys already pressed are still released.
+    void cancel();
+
+    // Feeds the HID queue with the next strokes, called from bt::on_report_sent and when core 1 has more.
+    void pump();
+
+    // a run is going and not all of its characters went out yet, false again once it is done or cancelled
+    bool busy() const { return running && chars_done < chars_total; }
+
+    // Host keyboard layout characters are mapped through, read by core 1.
+    std::atomic<kbd_layout> layout{kbd_layout::us};
+
+    std::atomic<mode> typing_mode{mode::single};
+
+    std::function<void(const progress& p)> on_progress;
+
+    static const char* state_to_str(state st);
+
+private:
+    // Text for core 1, tagged with the run it belongs to.
+    struct chunk {
+        uint32_t run;
+        uint8_t len;
+        char text[TYPIST_CHUNK_SIZE];
+    };
+
+    // One press report for core 0, and how many characters it (or skipping untypeable ones) used up.
+    struct stroke {
+        uint32_t run;
+        uint16_t chars;
+        bool press;  // false: only characters without a key
+        uint8_t rpt[8];
+    };
+
+    bt& b;
+    spsc_ring<chunk, TYPIST_TEXT_RING_SIZE> chunks;       // core 0 -> core 1
+    spsc_ring<stroke, TYPIST_STROKE_RING_SIZE> strokes;   // core 1 -> core 0
+    std::atomic<uint32_t> run{0};  // bumped by cancel(), older chunks and strokes are dropped
+    async_context_t *ctx{nullptr};
+    async_when_pending_worker_t pump_worker{};
+
+    // core 0
+    bool running{false};  // a run is typing or waiting for its last reports to go out
+    uint32_t chars_done{0};
+    uint32_t chars_total{0};
+    uint32_t reports_sent{0};
+    absolute_time_t started;
+    absolute_time_t last_progress;
+
+    // core 1: text taken from the ring, not typed yet
+    char text[TYPIST_CHUNK_SIZE * 2];
+    size_t text_len{0};
+    uint32_t text_run{0};
+
+    void wake_core1();
+    void drop_run();
+    void report(state st);
+    void finish(state st);
+
+    static void core1_main();
+    static void pump_work(async_context_t *ctx, async_when_pending_worker_t *worker);
+    void engine();
+    void fill();
+    bool next_stroke(stroke& s);
+};
@@ -1,5 +1,6 @@
 #include "websocket.h"
 #include "log.h"
+#include "core_load.h"
 #include "lwip/tcp.h"
 #include <string.h>
 #include <string>
@@ -75,164 +76,414 @@ static void b64enc(const uint8_t *in, size_t n, char *out) {
 
 // ---- ws_server ----
 
-void ws_server::close_client() {
-    if (!client_pcb_) return;
-    log("WS: client disconnected");
-    tcp_arg(client_pcb_, nullptr);
-    tcp_recv(client_pcb_, nullptr);
-    tcp_err(client_pcb_, nullptr);
-    tcp_close(client_pcb_);
-    client_pcb_ = nullptr;
-    hs_done_ = false;
-    recv_buf_.clear();
-}
-
-void ws_server::send_frame(struct tcp_pcb *pcb, const uint8_t *data, size_t len, uint8_t opcode) {
-    uint8_t hdr[4];
-    size_t hdr_len;
-    hdr[0] = 0x80 | opcode;
-    if (len < 126) {
-        hdr[1] = (uint8_t)len;
-        hdr_len = 2;
+// unmasked payload of the frame being received, one per client slot (kept out of ws_server, which lives on the stack)
+static uint8_t rx_scratch[WS_MAX_CLIENTS][WS_MAX_RX_PAYLOAD];
+
+// bytes the frame header starting at b needs, as far as the avail bytes seen so far tell
+static size_t header_size(const uint8_t *b, size_t avail) {
+    if (avail < 2) return 2;
+    size_t size = 2;
+    uint8_t plen = b[1] & 0x7f;
+    if (plen == 126) size += 2;
+    else if (plen == 127) size += 8;
+    if (b[1] & 0x80) size += 4;
+    return size;
+}
+
+void ws_server::client::reset() {
+    pcb = nullptr;
+    hs_done = false;
+    group = 0;
+    hs_buf.clear();
+    hs_buf.shrink_to_fit();
+    rx_st = rx_state::header;
+    rx_hdr_len = 0;
+    rx_plen = 0;
+    rx_pos = 0;
+    for (tx_frame& f : txq) f = tx_frame{};
+    txq_head = 0;
+    txq_len = 0;
+    head_acked = 0;
+    untracked = 0;
+}
+
+void ws_server::close_client(client& c) {
+    if (!c.pcb) return;
+    log("WS: client %u disconnected", c.slot);
+    tcp_arg(c.pcb, nullptr);
+    tcp_recv(c.pcb, nullptr);
+    tcp_sent(c.pcb, nullptr);
+    tcp_err(c.pcb, nullptr);
+    // tcp_close() keeps the pcb around to deliver what's unacked, and those segments point into our frames
+    // (written without a copy). reset() releases the frames, so the segments have to go with the pcb.
+    bool in_flight = false;
+    for (uint8_t i = 0; i < c.txq_len; i++) in_flight |= c.txq[(c.txq_head + i) % WS_TX_QUEUE_SIZE].written > 0;
+    if (in_flight) {
+        tcp_abort(c.pcb);
+        aborted_ = c.pcb;
     } else {
-        hdr[1] = 126;
-        hdr[2] = (len >> 8) & 0xff;
-        hdr[3] = len & 0xff;
-        hdr_len = 4;
-    }
-    err_t err = tcp_write(pcb, hdr, (u16_t)hdr_len, TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
-    if (err != ERR_OK) { log("WS: tx hdr err %d", (int)err); return; }
-    err = tcp_write(pcb, data, (u16_t)len, TCP_WRITE_FLAG_COPY);
-    if (err != ERR_OK) { log("WS: tx data err %d", (int)err); return; }
-    tcp_output(pcb);
-}
-
-void ws_server::send(const std::string& data) {
-    if (!client_pcb_ || !hs_done_) return;
-    send_frame(client_pcb_, (const uint8_t*)data.data(), data.size());
-}
-
-void ws_server::handle_data(struct tcp_pcb *pcb, const char *data, uint16_t len) {
-    recv_buf_.append(data, len);
-
-    if (!hs_done_) {
-        // Wait for end of HTTP headers
-        auto hdr_end = recv_buf_.find("\r\n\r\n");
-        if (hdr_end == std::string::npos) return;
-
-        // Extract Sec-WebSocket-Key
-        const char *key_hdr = "Sec-WebSocket-Key: ";
-        auto kpos = recv_buf_.find(key_hdr);
-        if (kpos == std::string::npos) { close_client(); return; }
-        kpos += strlen(key_hdr);
-        auto kend = recv_buf_.find("\r\n", kpos);
-        if (kend == std::string::npos) { close_client(); return; }
-        std::string key = recv_buf_.substr(kpos, kend - kpos);
-        log("WS: key=%s", key.c_str());
-
-        // Compute Sec-WebSocket-Accept = base64(SHA1(key + GUID))
-        std::string concat = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-        uint8_t sha[20]; char accept[32];
-        ::sha1((const uint8_t*)concat.data(), concat.size(), sha);
-        ::b64enc(sha, 20, accept);
-
-        char resp[256];
-        int rlen = snprintf(resp, sizeof(resp),
-            "HTTP/1.1 101 Switching Protocols\r\n"
-            "Upgrade: websocket\r\n"
-            "Connection: Upgrade\r\n"
-            "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
-        tcp_write(pcb, resp, (u16_t)rlen, TCP_WRITE_FLAG_COPY);
-        tcp_output(pcb);
-
-        hs_done_ = true;
-        recv_buf_ = recv_buf_.substr(hdr_end + 4);
-        log("WS: connected");
-        if (on_message) on_message("__connected__");
-        return;
-    }
-
-    // Parse WebSocket frames (client frames are always masked, RFC 6455 §5.3)
-    while (recv_buf_.size() >= 2) {
-        const uint8_t *b = (const uint8_t*)recv_buf_.data();
-        uint8_t opcode = b[0] & 0x0f;
-        bool    masked = (b[1] & 0x80) != 0;
-        size_t  plen   = b[1] & 0x7f;
-        size_t  offset = 2;
-
-        if (plen == 126) {
-            if (recv_buf_.size() < 4) return;
-            plen   = ((size_t)b[2] << 8) | b[3];
-            offset = 4;
-        } else if (plen == 127) {
-            // 64-bit length not needed for our use case
-            close_client(); return;
+        tcp_close(c.pcb);
+    }
+    c.reset();
+}
+
+void ws_server::drop_clients() {
+    for (client& c : clients_) {
+        if (!c.pcb) continue;
+        log("WS: client %u dropped", c.slot);
+        tcp_arg(c.pcb, nullptr);
+        tcp_recv(c.pcb, nullptr);
+        tcp_sent(c.pcb, nullptr);
+        tcp_err(c.pcb, nullptr);
+        // no FIN handshake over a dead link, the PCB is freed right away
+        tcp_abort(c.pcb);
+        c.reset();
+    }
+}
+
+size_t ws_server::client_count(uint8_t group) const {
+    size_t n = 0;
+    for (const client& c : clients_) {
+        if (c.pcb && c.hs_done && (group == WS_GROUP_ALL || c.group == group)) n++;
+    }
+    return n;
+}
+
+void ws_server::set_group(uint8_t client, uint8_t group) {
+    if (client < WS_MAX_CLIENTS) clients_[client].group = group;
+}
+
+// Returns false if the frame was dropped because the client's queue is full.
+bool ws_server::enqueue(client& c, const ws_frame_ref& frame, uint8_t key) {
+    if (key != 0) {
+        // replace a superseded frame that hasn't started going out, it keeps its place in the queue
+        for (uint8_t i = 0; i < c.txq_len; i++) {
+            tx_frame& f = c.txq[(c.txq_head + i) % WS_TX_QUEUE_SIZE];
+            if (f.key == key && f.written == 0) {
+                f.buf = frame;
+                tx_superseded++;
+                return true;
+            }
         }
+    }
+
+    if (c.txq_len == WS_TX_QUEUE_SIZE) {
+        tx_dropped++;
+        if (log_enabled()) log("WS: client %u transmit queue full, dropping %u bytes", c.slot, (unsigned)frame.size());
+        return false;
+    }
+    c.txq[(c.txq_head + c.txq_len) % WS_TX_QUEUE_SIZE] = tx_frame{frame, key, 0};
+    c.txq_len++;
+    return true;
+}
+
+// Hands as much of the queue to lwIP as the send buffer takes.
+void ws_server::pump(client& c) {
+    if (!c.pcb) return;
+    bool wrote = false;
+    for (uint8_t i = 0; i < c.txq_len; i++) {
+        tx_frame& f = c.txq[(c.txq_head + i) % WS_TX_QUEUE_SIZE];
+        size_t left = f.buf.size() - f.written;
+        if (left == 0) continue;
+
+        size_t room = tcp_sndbuf(c.pcb);
+        if (room == 0) break;
+        size_t n = left < room ? left : room;
+        bool more = n < left || i + 1 < c.txq_len;
+        // no copy: buf stays referenced by the queue until acked()
+        err_t err = tcp_write(c.pcb, f.buf.data() + f.written, (u16_t)n, more ? TCP_WRITE_FLAG_MORE : 0);
+        if (err != ERR_OK) {
+            if (err != ERR_MEM) log("WS: client %u tx err %d", c.slot, (int)err);
+            break;  // ERR_MEM: segment queue full, on_sent tries again
+        }
+        f.written += n;
+        wrote = true;
+        if (f.written < f.buf.size()) break;
+    }
+    if (wrote) tcp_output(c.pcb);
+}
+
+// Releases frames the peer has acknowledged.
+void ws_server::acked(client& c, size_t len) {
+    size_t n = len < c.untracked ? len : c.untracked;
+    c.untracked -= n;
+    len -= n;
+
+    while (len > 0 && c.txq_len > 0) {
+        tx_frame& f = c.txq[c.txq_head];
+        n = f.buf.size() - c.head_acked;
+        if (n > len) n = len;
+        c.head_acked += n;
+        len -= n;
+        if (c.head_acked == f.buf.size()) {
+            f = tx_frame{};
+            c.txq_head = (c.txq_head + 1) % WS_TX_QUEUE_SIZE;
+            c.txq_len--;
+            c.head_acked = 0;
+        }
+    }
+}
+
+void ws_server::send(const char* data, size_t len, uint8_t key, uint8_t group) {
+    broadcast((const uint8_t*)data, len, 0x01, key, group);
+}
+
+void ws_server::send_binary(const uint8_t* data, size_t len, uint8_t key, uint8_t group) {
+    broadcast(data, len, 0x02, key, group);
+}
+
+void ws_server::broadcast(const uint8_t *data, size_t len, uint8_t opcode, uint8_t key, uint8_t group) {
+    ws_frame_ref frame;
+    for (client& c : clients_) {
+        if (!c.pcb || !c.hs_done) continue;
+        if (group != WS_GROUP_ALL && c.group != group) continue;
+        // serialized and framed once, the same buffer goes to every client
+        if (!frame) {
+            frame = ws_frame_ref::make(data, len, opcode);
+            if (!frame) {
+                tx_dropped++;
+                if (log_enabled()) log("WS: no frame buffer for %u bytes, dropped", (unsigned)len);
+                return;
+            }
+        }
+        if (enqueue(c, frame, key)) pump(c);
+    }
+}
+
+// Returns false if the client was closed.
+bool ws_server::handle_handshake(client& c, const char *data, uint16_t len) {
+    if (c.hs_buf.size() + len > WS_MAX_HANDSHAKE) {
+        log("WS: client %u handshake too long", c.slot);
+        close_client(c);
+        return false;
+    }
+    c.hs_buf.append(data, len);
+
+    // Wait for end of HTTP headers
+    auto hdr_end = c.hs_buf.find("\r\n\r\n");
+    if (hdr_end == std::string::npos) return true;
+
+    // Extract Sec-WebSocket-Key
+    const char *key_hdr = "Sec-WebSocket-Key: ";
+    auto kpos = c.hs_buf.find(key_hdr);
+    if (kpos == std::string::npos) { close_client(c); return false; }
+    kpos += strlen(key_hdr);
+    auto kend = c.hs_buf.find("\r\n", kpos);
+    if (kend == std::string::npos) { close_client(c); return false; }
+    std::string key = c.hs_buf.substr(kpos, kend - kpos);
+    log("WS: key=%s", key.c_str());
 
-        size_t frame_size = offset + (masked ? 4u : 0u) + plen;
-        if (recv_buf_.size() < frame_size) return;  // wait for more data
+    // Compute Sec-WebSocket-Accept = base64(SHA1(key + GUID))
+    std::string concat = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    uint8_t sha[20]; char accept[32];
+    ::sha1((const uint8_t*)concat.data(), concat.size(), sha);
+    ::b64enc(sha, 20, accept);
 
-        if (opcode == 0x08) { close_client(); return; }  // close frame
+    char resp[256];
+    int rlen = snprintf(resp, sizeof(resp),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    tcp_write(c.pcb, resp, (u16_t)rlen, TCP_WRITE_FLAG_COPY);
+    tcp_output(c.pcb);
+    c.untracked += (size_t)rlen;
+
+    c.hs_done = true;
+    std::string rest = c.hs_buf.substr(hdr_end + 4);
+    c.hs_buf.clear();
+    c.hs_buf.shrink_to_fit();
+    log("WS: client %u connected", c.slot);
+    if (on_connected) on_connected(c.slot);
+
+    // frames that came in the same segment as the request
+    return rest.empty() || feed(c, (const uint8_t*)rest.data(), rest.size());
+}
+
+// Takes the frame header in h (complete, see header_size). Returns false for frames we don't accept.
+bool ws_server::parse_header(client& c, const uint8_t *h) {
+    c.rx_opcode = h[0] & 0x0f;
+    c.rx_masked = (h[1] & 0x80) != 0;
+    c.rx_plen   = h[1] & 0x7f;
+    size_t offset = 2;
+
+    if (c.rx_plen == 126) {
+        c.rx_plen = ((size_t)h[2] << 8) | h[3];
+        offset = 4;
+    } else if (c.rx_plen == 127) {
+        // 64-bit length not needed for our use case
+        return false;
+    }
+    if (c.rx_plen > WS_MAX_RX_PAYLOAD) {
+        log("WS: frame of %u bytes too large", (unsigned)c.rx_plen);
+        return false;
+    }
+    if (c.rx_masked) memcpy(c.rx_mask, h + offset, 4);
+    c.rx_pos = 0;
+    return true;
+}
 
-        if (opcode == 0x09) {  // ping -> pong
-            send_frame(pcb, b + offset + (masked ? 4u : 0u), plen, 0x0a);
-        } else if (opcode == 0x01 || opcode == 0x02) {  // text / binary
-            std::string payload;
-            if (masked) {
-                const uint8_t *mask  = b + offset;
-                const uint8_t *pdata = b + offset + 4;
-                payload.resize(plen);
-                for (size_t i = 0; i < plen; i++) payload[i] = pdata[i] ^ mask[i & 3];
+// Acts on a complete frame. Returns false if the client was closed.
+bool ws_server::dispatch(client& c, const uint8_t *payload, size_t len) {
+    if (c.rx_opcode == 0x08) { close_client(c); return false; }  // close frame
+
+    if (c.rx_opcode == 0x09) {  // ping -> pong
+        ws_frame_ref pong = ws_frame_ref::make(payload, len, 0x0a);
+        if (pong && enqueue(c, pong, 0)) pump(c);
+    } else if (c.rx_opcode == 0x01 || c.rx_opcode == 0x02) {  // text / binary
+        if (on_message) on_message(c.slot, payload, len);
+    }
+    return true;
+}
+
+// Decodes WebSocket frames from one segment (client frames are always masked, RFC 6455 §5.3).
+// Returns false if the client was closed.
+bool ws_server::feed(client& c, const uint8_t *data, size_t len) {
+    uint8_t *scratch = rx_scratch[c.slot];
+    size_t i = 0;
+    while (i < len) {
+        if (c.rx_st == client::rx_state::header) {
+            const uint8_t *h = nullptr;
+            if (c.rx_hdr_len == 0 && len - i >= header_size(data + i, len - i)) {
+                // whole header in this segment, parse it in place
+                h = data + i;
+                i += header_size(h, len - i);
             } else {
-                payload.assign((const char*)(b + offset), plen);
+                // header spans segments, gather it
+                while (i < len && c.rx_hdr_len < header_size(c.rx_hdr, c.rx_hdr_len)) c.rx_hdr[c.rx_hdr_len++] = data[i++];
+                if (c.rx_hdr_len < header_size(c.rx_hdr, c.rx_hdr_len)) return true;  // wait for more data
+                h = c.rx_hdr;
+            }
+            c.rx_hdr_len = 0;
+
+            if (!parse_header(c, h)) { close_client(c); return false; }
+            if (c.rx_plen == 0) {
+                if (!dispatch(c, scratch, 0)) return false;
+                continue;
             }
-            if (on_message) on_message(payload);
+            c.rx_st = client::rx_state::payload;
         }
 
-        recv_buf_.erase(0, frame_size);
+        size_t n = len - i;
+        if (n > c.rx_plen - c.rx_pos) n = c.rx_plen - c.rx_pos;
+        const uint8_t *src = data + i;
+        i += n;
+
+        if (!c.rx_masked && c.rx_pos == 0 && n == c.rx_plen) {
+            // unmasked and contiguous, hand the segment itself over
+            c.rx_st = client::rx_state::header;
+            if (!dispatch(c, src, n)) return false;
+            continue;
+        }
+
+        if (c.rx_masked) {
+            for (size_t k = 0; k < n; k++) scratch[c.rx_pos + k] = src[k] ^ c.rx_mask[(c.rx_pos + k) & 3];
+        } else {
+            memcpy(scratch + c.rx_pos, src, n);
+        }
+        c.rx_pos += n;
+
+        if (c.rx_pos == c.rx_plen) {
+            c.rx_st = client::rx_state::header;
+            if (!dispatch(c, scratch, c.rx_plen)) return false;
+        }
     }
+    return true;
 }
 
 err_t ws_server::on_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
-    ws_server *self = (ws_server*)arg;
-    if (!p) { self->close_client(); return ERR_OK; }
-    for (struct pbuf *q = p; q; q = q->next)
-        self->handle_data(tpcb, (const char*)q->payload, q->len);
-    tcp_recved(tpcb, p->tot_len);
-    pbuf_free(p);
+    busy_scope busy;
+    client& c = *(client*)arg;
+    ws_server *self = c.server;
+    self->aborted_ = nullptr;
+    bool open = true;
+    if (!p) {
+        self->close_client(c);
+    } else {
+        for (struct pbuf *q = p; q && open; q = q->next) {
+            open = c.hs_done ? self->feed(c, (const uint8_t*)q->payload, q->len)
+                             : self->handle_handshake(c, (const char*)q->payload, q->len);
+        }
+        if (open) tcp_recved(tpcb, p->tot_len);  // pcb is gone once the client was closed
+        pbuf_free(p);
+    }
+    // lwIP must not touch an aborted pcb once the callback returns
+    return self->aborted_ == tpcb ? ERR_ABRT : ERR_OK;
+}
+
+err_t ws_server::on_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+    busy_scope busy;
+    client& c = *(client*)arg;
+    c.server->acked(c, len);
+    c.server->pump(c);
     return ERR_OK;
 }
 
 void ws_server::on_err(void *arg, err_t err) {
-    ws_server *self = (ws_server*)arg;
-    log("WS: error %d", (int)err);
+    client& c = *(client*)arg;
+    log("WS: client %u error %d", c.slot, (int)err);
     // tcp_pcb is already freed by lwIP at this point, do not call tcp_close
-    self->client_pcb_ = nullptr;
-    self->hs_done_ = false;
-    self->recv_buf_.clear();
+    c.reset();
 }
 
 err_t ws_server::on_accept(void *arg, struct tcp_pcb *newpcb, err_t err) {
     if (err != ERR_OK || !newpcb) return ERR_VAL;
     ws_server *self = (ws_server*)arg;
-    if (self->client_pcb_) self->close_client();  // drop previous client
-    log("WS: new connection");
-    self->client_pcb_ = newpcb;
-    self->hs_done_ = false;
-    self->recv_buf_.clear();
-    tcp_arg(newpcb, self);
+
+    client *slot = nullptr;
+    for (client& c : self->clients_) {
+        if (!c.pcb) { slot = &c; break; }
+    }
+    if (!slot) {
+        // a client that never finished its handshake is the first to go, established ones are kept
+        for (client& c : self->clients_) {
+            if (!c.hs_done) { self->close_client(c); slot = &c; break; }
+        }
+    }
+    if (!slot) {
+        log("WS: %u clients connected, refusing new connection", (unsigned)WS_MAX_CLIENTS);
+        tcp_abort(newpcb);
+        return ERR_ABRT;
+    }
+
+    log("WS: new connection in slot %u", slot->slot);
+    slot->reset();
+    slot->pcb = newpcb;
+    tcp_arg(newpcb, slot);
     tcp_recv(newpcb, on_recv);
+    tcp_sent(newpcb, on_sent);
     tcp_err(newpcb, on_err);
-    tcp_setprio(newpcb, TCP_PRIO_MIN);
+    // input commands are tiny and latency bound: send them right away, and keep this pcb
+    // over bulk connections (HTTP) when lwIP runs out of pcbs
+    tcp_nagle_disable(newpcb);
+    tcp_setprio(newpcb, TCP_PRIO_MAX);
     return ERR_OK;
 }
 
-void ws_server::init(uint16_t port) {
+bool ws_server::init(uint16_t port) {
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+        clients_[i].server = this;
+        clients_[i].slot = (uint8_t)i;
+    }
+
     struct tcp_pcb *pcb = tcp_new();
-    LWIP_ASSERT("ws tcp_new", pcb != nullptr);
-    tcp_bind(pcb, IP_ADDR_ANY, port);
+    if (!pcb) {
+        log("WS: no PCB for port %u", port);
+        return false;
+    }
+    if (tcp_bind(pcb, IP_ADDR_ANY, port) != ERR_OK) {
+        log("WS: port %u taken", port);
+        tcp_close(pcb);
+        return false;
+    }
     listen_pcb_ = tcp_listen(pcb);
+    if (!listen_pcb_) {
+        log("WS: listen on port %u failed", port);
+        tcp_close(pcb);
+        return false;
+    }
     tcp_arg(listen_pcb_, this);
     tcp_accept(listen_pcb_, on_accept);
     log("WS: listening on port %u", port);
+    return true;
 }
@@ -1,31 +1,124 @@
 #pragma once
 #include "lwip/tcp.h"
+#include "ws_frame.h"
+#include <cstdint>
 #include <functional>
 #include <string>
 
+// Largest frame payload accepted from the client. CMD_TYPE chunks are the biggest (3 + 512 bytes).
+constexpr size_t WS_MAX_RX_PAYLOAD = 1024;
+
+// Most browsers/devices connected at once, further connections are refused.
+constexpr size_t WS_MAX_CLIENTS = 4;
+
+// Longest HTTP upgrade request accepted from a client.
+constexpr size_t WS_MAX_HANDSHAKE = 1024;
+
+// Outgoing frames that can wait per client for TCP send buffer space.
+constexpr size_t WS_TX_QUEUE_SIZE = 8;
+
+// send() group that matches every client
+constexpr uint8_t WS_GROUP_ALL = 0xff;
+
 // Minimal WebSocket server using lwIP raw TCP API.
-// Supports a single client connection at a time.
+// Serves up to WS_MAX_CLIENTS clients at a time, send() goes to all of them or to one group.
 // Must call send() from within the lwIP context (e.g. inside a TCP callback
 // or between cyw43_arch_lwip_begin() / cyw43_arch_lwip_end()).
 class ws_server {
 public:
-    // Called when a text/binary frame is received, or "__connected__" on connect.
-    std::function<void(const std::string&)> on_message;
+    // Called when a text/binary frame is received from a client. The payload is only valid during the call.
+    std::function<void(uint8_t client, const uint8_t* data, size_t len)> on_message;
+
+    // Called once the handshake with a new client is done.
+    std::function<void(uint8_t client)> on_connected;
+
+    // Starts listening on port. Returns false if lwIP had no PCB to spare or the port is taken, init() can be tried again.
+    bool init(uint16_t port);
+
+    bool listening() const { return listen_pcb_ != nullptr; }
+
+    // Drops every client connection at once, for when the network under them is gone. The listener stays.
+    void drop_clients();
+
+    /**
+     * Sends one text frame to every connected client in group (all of them by default).
+     * The frame is built once in a pooled buffer (see ws_frame.h) and queued by reference for each client,
+     * then handed to lwIP without a copy as send buffer space allows. No buffer left counts as tx_dropped.
+     * Frames with the same non-zero key supersede each other: a newer one takes the place of an older one
+     * still waiting in a client's queue.
+     */
+    void send(const char* data, size_t len, uint8_t key = 0, uint8_t group = WS_GROUP_ALL);
+    void send(const std::string& data, uint8_t key = 0) { send(data.data(), data.size(), key); }
 
-    void init(uint16_t port);
-    void send(const std::string& data);
+    // Same as send(), as a binary frame.
+    void send_binary(const uint8_t* data, size_t len, uint8_t key = 0, uint8_t group = WS_GROUP_ALL);
+
+    // Moves a client to another group, new clients start in group 0.
+    void set_group(uint8_t client, uint8_t group);
+
+    size_t client_count(uint8_t group = WS_GROUP_ALL) const;
+
+    // frames not sent because a client's transmit queue was full, or the frame pool empty
+    uint32_t tx_dropped{0};
+
+    // frames that replaced an older one with the same key before it went out
+    uint32_t tx_superseded{0};
 
 private:
+    // Frame waiting for (or in) the TCP send buffer. lwIP references buf until the bytes are acked.
+    struct tx_frame {
+        ws_frame_ref buf;
+        uint8_t key{0};
+        size_t written{0};  // bytes passed to tcp_write
+    };
+
+    struct client {
+        ws_server *server{nullptr};
+        uint8_t slot{0};
+        struct tcp_pcb *pcb{nullptr};
+        bool hs_done{false};
+        uint8_t group{0};
+        std::string hs_buf;  // HTTP upgrade request, only until the handshake is done
+
+        // Streaming frame decoder, fed straight from the pbuf segments.
+        // Headers are parsed in place unless they span segments, payloads are unmasked into the
+        // client's fixed scratch buffer as they arrive.
+        enum class rx_state : uint8_t { header, payload };
+        rx_state rx_st{rx_state::header};
+        uint8_t rx_hdr[14];        // header gathered across segments
+        uint8_t rx_hdr_len{0};
+        uint8_t rx_opcode{0};
+        bool rx_masked{false};
+        uint8_t rx_mask[4];
+        size_t rx_plen{0};
+        size_t rx_pos{0};          // payload bytes received so far
+
+        // Transmit queue, oldest first. Only the head can be partly acked.
+        tx_frame txq[WS_TX_QUEUE_SIZE];
+        uint8_t txq_head{0};
+        uint8_t txq_len{0};
+        size_t head_acked{0};
+        size_t untracked{0};       // bytes written outside the queue (handshake) not acked yet
+
+        void reset();
+    };
+
     struct tcp_pcb *listen_pcb_{nullptr};
-    struct tcp_pcb *client_pcb_{nullptr};
-    bool hs_done_{false};
-    std::string recv_buf_;
+    struct tcp_pcb *aborted_{nullptr};  // last pcb close_client() had to abort, on_recv() reports it to lwIP
+    client clients_[WS_MAX_CLIENTS];
 
     static err_t on_accept(void *arg, struct tcp_pcb *newpcb, err_t err);
     static err_t on_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
     static void  on_err(void *arg, err_t err);
+    static err_t on_sent(void *arg, struct tcp_pcb *tpcb, u16_t len);
 
-    void close_client();
-    void handle_data(struct tcp_pcb *pcb, const char *data, uint16_t len);
-    void send_frame(struct tcp_pcb *pcb, const uint8_t *data, size_t len, uint8_t opcode = 0x01);
+    void close_client(client& c);
+    bool handle_handshake(client& c, const char *data, uint16_t len);
+    bool feed(client& c, const uint8_t *data, size_t len);
+    bool parse_header(client& c, const uint8_t *h);
+    bool dispatch(client& c, const uint8_t *payload, size_t len);
+    void broadcast(const uint8_t *data, size_t len, uint8_t opcode, uint8_t key, uint8_t group);
+    bool enqueue(client& c, const ws_frame_ref& frame, uint8_t key);
+    void pump(client& c);
+    void acked(client& c, size_t len);
 };
@@ -0,0 +1,56 @@
+#include "ws_frame.h"
+#include <string.h>
+
+namespace {
+
+uint8_t small_bufs[WS_FRAME_SMALL_COUNT][WS_FRAME_SMALL_SIZE];
+uint8_t large_bufs[WS_FRAME_LARGE_COUNT][WS_FRAME_LARGE_SIZE];
+ws_frame small_frames[WS_FRAME_SMALL_COUNT];
+ws_frame large_frames[WS_FRAME_LARGE_COUNT];
+
+// first free frame of a pool, bound to its buffer
+template <size_t N>
+ws_frame* take(ws_frame *frames, uint8_t (*bufs)[N], size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        ws_frame& f = frames[i];
+        if (f.refs != 0) continue;
+        f.buf = bufs[i];
+        f.cap = (uint16_t)N;
+        return &f;
+    }
+    return nullptr;
+}
+
+} // namespace
+
+ws_frame_ref ws_frame_ref::make(const uint8_t *payload, size_t len, uint8_t opcode) {
+    ws_frame_ref r;
+    if (len > WS_MAX_TX_PAYLOAD) return r;
+    size_t hdr = len < 126 ? 2 : 4;
+    ws_frame *f = nullptr;
+    // a small frame may take a large buffer when the small ones are out, not the other way round
+    if (hdr + len <= WS_FRAME_SMALL_SIZE) f = take(small_frames, small_bufs, WS_FRAME_SMALL_COUNT);
+    if (!f) f = take(large_frames, large_bufs, WS_FRAME_LARGE_COUNT);
+    if (!f) return r;
+
+    f->buf[0] = (uint8_t)(0x80 | opcode);
+    if (len < 126) {
+        f->buf[1] = (uint8_t)len;
+    } else {
+        f->buf[1] = 126;
+        f->buf[2] = (uint8_t)(len >> 8);
+        f->buf[3] = (uint8_t)len;
+    }
+    memcpy(f->buf + hdr, payload, len);
+    f->len = (uint16_t)(hdr + len);
+    f->refs = 1;
+    r.f_ = f;
+    return r;
+}
+
+ws_frame_pool_stats ws_frame_pool_usage() {
+    ws_frame_pool_stats s{0, 0};
+    for (const ws_frame& f : small_frames) s.small_used += f.refs != 0;
+    for (const ws_frame& f : large_frames) s.large_used += f.refs != 0;
+    return s;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Largest payload of an outgoing frame, the full status JSON is the biggest (HTTPD_JSON_BUF_SIZE).
+constexpr size_t WS_MAX_TX_PAYLOAD = 2048;
+
+// Outgoing frame buffers, allocated once. Deltas, heartbeats, typing progress and pongs take a small one,
+// full states and binary status frames a large one. Large frames are keyed, so each client holds one at most.
+constexpr size_t WS_FRAME_SMALL_SIZE = 256;
+constexpr size_t WS_FRAME_SMALL_COUNT = 24;
+constexpr size_t WS_FRAME_LARGE_SIZE = WS_MAX_TX_PAYLOAD + 4;
+constexpr size_t WS_FRAME_LARGE_COUNT = 6;
+
+// A pool buffer holding one complete frame (header and payload), free while refs is 0.
+struct ws_frame {
+    uint8_t *buf;
+    uint16_t cap;
+    uint16_t len;
+    uint16_t refs;
+};
+
+/**
+ * Reference to a pooled frame, counted like a shared_ptr: the buffer goes back to the pool when the last
+ * reference is gone. Empty if the pool had no buffer left. Not thread safe, frames live in the lwIP context.
+ */
+class ws_frame_ref {
+public:
+    ws_frame_ref() = default;
+    ~ws_frame_ref() { release(); }
+    ws_frame_ref(const ws_frame_ref& o) : f_(o.f_) { if (f_) f_->refs++; }
+    ws_frame_ref(ws_frame_ref&& o) noexcept : f_(o.f_) { o.f_ = nullptr; }
+    ws_frame_ref& operator=(const ws_frame_ref& o) {
+        if (o.f_) o.f_->refs++;
+        release();
+        f_ = o.f_;
+        return *this;
+    }
+    ws_frame_ref& operator=(ws_frame_ref&& o) noexcept {
+        if (this != &o) {
+            release();
+            f_ = o.f_;
+            o.f_ = nullptr;
+        }
+        return *this;
+    }
+
+    // Frames payload (len bytes) with opcode into a free buffer that fits it.
+    static ws_frame_ref make(const uint8_t *payload, size_t len, uint8_t opcode);
+
+    explicit operator bool() const { return f_ != nullptr; }
+    const uint8_t* data() const { return f_->buf; }
+    size_t size() const { return f_->len; }
+
+private:
+    ws_frame *f_{nullptr};
+
+    void release() {
+        if (f_) f_->refs--;
+        f_ = nullptr;
+    }
+};
+
+// frame buffers in use, of each size
+struct ws_frame_pool_stats {
+    uint16_t small_used;
+    uint16_t large_used;
+};
+
+ws_frame_pool_stats ws_frame_pool_usage();